@@ -8,6 +8,19 @@ static adc2_config_t adc2_config;
 static int adc1_results[2];
 static int adc2_results[4];
 
+// Continuous (DMA) sampling
+static adc_digi_pattern_config_t dma_pattern[ADC_LIB_DMA_MAX_CHANNELS];
+static int dma_pattern_num = 0;
+static uint32_t dma_channel_freq = 0;           // "0" if DMA is not used
+static bool dma_initialized = 0;
+static volatile int dma_last[ADC1_CHANNEL_MAX]; // Newest conversion of each channel
+static uint8_t dma_buffer[ADC_LIB_DMA_FRAME_BYTES];
+
+static int adc1_read(adc1_channel_t channel) {
+    if (dma_channel_freq) return dma_last[channel];
+    return adc1_get_raw(channel);
+}
+
 
 // Initialize ADC1 channels
 void adc1_lib_init(adc1_config_t *config) {
@@ -49,7 +62,7 @@ void adc_lib_init_all(adc1_config_t *config1, adc2_config_t *config2) {
 
 // Read single ADC1 channel
 int adc1_lib_read(adc1_channel_t channel) {
-    return adc1_get_raw(channel);
+    return adc1_read(channel);
 }
 
 // Read single ADC2 channel
@@ -64,7 +77,7 @@ void adc_lib_read_all(int *adc1_results, int *adc2_results) {
 
     // Read ADC1 channels
     for (int i = 0; i < adc1_config.adc1_num_channels; i++) {
-        adc1_results[i] = adc1_get_raw(adc1_config.adc1_channels[i]);
+        adc1_results[i] = adc1_read(adc1_config.adc1_channels[i]);
     }
 
     // Read ADC2 channels
@@ -81,7 +94,7 @@ void adc_lib_read_all_logical(int *adc1_results, int *adc2_results, int *rx_buff
 
     // Read ADC1 channels
     for (int i = 0; i < adc1_config.adc1_num_channels; i++) {
-        adc1_results[i] = adc1_get_raw(adc1_config.adc1_channels[i]);
+        adc1_results[i] = adc1_read(adc1_config.adc1_channels[i]);
         if (adc1_results[i] >= threshold) rx_buffer[i] = (rx_buffer[i] << 1) | 1;
         else rx_buffer[i] = (rx_buffer[i] << 1) | 0;
     }
@@ -105,9 +118,14 @@ void adc_lib_read_all_logical(int *adc1_results, int *adc2_results, int *rx_buff
 // Global configuration structure
 static adc1_config_t adc_dis_config;
 
+static esp_err_t adc_lib_dma_add(adc1_config_t *config);
+
 void adc_lib_dis_init(adc1_config_t *config) {
     adc_dis_config = *config;
 
+    // Channels are read one by one if they can't join DMA
+    if (dma_channel_freq && (adc_lib_dma_add(config) == ESP_OK)) return;
+
     // Configure ADC1
     adc1_config_width(adc_dis_config.width);
     for (int i = 0; i < adc_dis_config.adc1_num_channels; i++) {
@@ -120,7 +138,125 @@ void adc_lib_dis_read_all(int *adc_dis_results) {
 
     // Read ADC1 channels
     for (int i = 0; i < adc_dis_config.adc1_num_channels; i++) {
-        adc_dis_results[i] = adc1_get_raw(adc_dis_config.adc1_channels[i]);
+        adc_dis_results[i] = adc1_read(adc_dis_config.adc1_channels[i]);
+    }
+
+}
+
+
+// **************       Continuous (DMA) ADC       **************
+
+// (Re)start DMA with current pattern, channels can only be changed while stopped
+static esp_err_t adc_lib_dma_configure(void) {
+    uint32_t mask = 0;
+
+    for (int i = 0; i < dma_pattern_num; i++) mask |= 1 << dma_pattern[i].channel;
+
+    adc_digi_init_config_t init_config = {
+        .max_store_buf_size = ADC_LIB_DMA_BUFFER_BYTES,
+        .conv_num_each_intr = ADC_LIB_DMA_FRAME_BYTES,
+        .adc1_chan_mask = mask,
+        .adc2_chan_mask = 0,
+    };
+    adc_digi_configuration_t dig_config = {
+        .conv_limit_en = 1,     // Required on ESP32
+        .conv_limit_num = 250,
+        .pattern_num = dma_pattern_num,
+        .adc_pattern = dma_pattern,
+        .sample_freq_hz = dma_channel_freq * dma_pattern_num,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+    };
+
+    if (dig_config.sample_freq_hz < SOC_ADC_SAMPLE_FREQ_THRES_LOW) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t err = adc_digi_initialize(&init_config);
+    if (err != ESP_OK) return err;
+    dma_initialized = 1;
+
+    err = adc_digi_controller_configure(&dig_config);
+    if (err == ESP_OK) err = adc_digi_start();
+    return err;
+}
+
+static esp_err_t adc_lib_dma_append(adc1_config_t *config) {
+    for (int i = 0; i < config->adc1_num_channels; i++) {
+        if (dma_pattern_num >= ADC_LIB_DMA_MAX_CHANNELS) return ESP_ERR_NO_MEM;
+
+        dma_pattern[dma_pattern_num++] = (adc_digi_pattern_config_t) {
+            .atten = config->atten,
+            .channel = config->adc1_channels[i],
+            .unit = ADC_UNIT_1,
+            .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+        };
     }
+    return ESP_OK;
+}
+
+// DMA is stopped and given up, ADC1 is read directly again
+static void adc_lib_dma_reset(void) {
+    if (dma_initialized) {
+        adc_digi_stop();
+        adc_digi_deinitialize();
+        dma_initialized = 0;
+    }
+    dma_channel_freq = 0;
+    dma_pattern_num = 0;
+}
+
+// Add channels to running DMA
+static esp_err_t adc_lib_dma_add(adc1_config_t *config) {
+    if (dma_initialized) {
+        adc_digi_stop();
+        adc_digi_deinitialize();
+        dma_initialized = 0;
+    }
+
+    esp_err_t err = adc_lib_dma_append(config);
+    if (err == ESP_OK) err = adc_lib_dma_configure();
+    if (err != ESP_OK) adc_lib_dma_reset();
+    return err;
+}
+
+esp_err_t adc_lib_dma_init(adc1_config_t *config, uint32_t channel_freq) {
+    dma_channel_freq = channel_freq;
+    dma_pattern_num = 0;
+
+    // Distance channels could be initialized before
+    esp_err_t err = adc_lib_dma_append(&adc_dis_config);
+    if (err == ESP_OK) err = adc_lib_dma_append(config);
+    if (err == ESP_OK) err = adc_lib_dma_configure();
+    if (err != ESP_OK) adc_lib_dma_reset();
+    return err;
+}
 
-}
\ No newline at end of file
+bool adc_lib_dma_running(void) {
+    return dma_channel_freq != 0;
+}
+
+int adc_lib_dma_read(adc_lib_sample_t *samples, int max_samples, uint32_t timeout_ms) {
+    uint32_t length = 0;
+    int n = 0;
+
+    uint32_t max_bytes = max_samples * SOC_ADC_DIGI_RESULT_BYTES;
+    if (max_bytes > sizeof(dma_buffer)) max_bytes = sizeof(dma_buffer);
+
+    // DMA was given up, reader still waits like for an empty frame
+    if (!dma_initialized) {
+        vTaskDelay(pdMS_TO_TICKS(timeout_ms));
+        return 0;
+    }
+
+    if (adc_digi_read_bytes(dma_buffer, max_bytes, &length, timeout_ms) != ESP_OK) return 0;
+
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        adc_digi_output_data_t *p = (adc_digi_output_data_t *)&dma_buffer[i];
+
+        if (p->type1.channel >= ADC1_CHANNEL_MAX) continue;
+        samples[n].channel = p->type1.channel;
+        samples[n].value = p->type1.data;
+        dma_last[p->type1.channel] = p->type1.data;
+        n++;
+    }
+    return n;
+}
@@ -10,6 +10,12 @@
  * was a little faster than adc_oneshot.h (especially ADC2, which 
  * is used a lot).
  * 
+ * ADC1 channels can also be sampled continuously with DMA (ADC_LIB_DMA).
+ * Conversions are stored by the driver in a ring buffer and read in
+ * blocks with adc_lib_dma_read(). While DMA is running ADC1 can't be
+ * read directly, so ADC1 values of adc_lib_read_all() and 
+ * adc_lib_dis_read_all() are the newest DMA conversions.
+ * 
  */
 
 
@@ -18,14 +24,24 @@
 
 // C/C++ libraries
 #include <stdio.h>
+#include <stdbool.h>
 
 // ESP-IDF libraries
 #include "driver/adc.h"
 #include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 // Personal libraries
 #include "io_define.h"
 
+
+#define ADC_LIB_DMA             0       // Sample ADC1 channels continuously with DMA
+
+#define ADC_LIB_DMA_MAX_CHANNELS    8       // Channels in DMA pattern
+#define ADC_LIB_DMA_FRAME_BYTES     256     // Bytes of conversions per DMA frame
+#define ADC_LIB_DMA_BUFFER_BYTES    2048    // Driver ring buffer size
+
 // Structure to hold ADC configuration
 typedef struct {
     adc1_channel_t *adc1_channels;
@@ -41,6 +57,12 @@ typedef struct {
     adc_atten_t atten;
 } adc2_config_t;
 
+// One DMA conversion
+typedef struct {
+    adc1_channel_t channel;
+    int value;
+} adc_lib_sample_t;
+
 
 /**
  * @brief Initialize ADC1
@@ -122,4 +144,43 @@ void adc_lib_dis_init(adc1_config_t *config);
  */
 void adc_lib_dis_read_all(int *adc_dis_results);
 
+
+/**
+ * @brief Start continuous (DMA) sampling of ADC1
+ * 
+ * Channels of distance ADC (adc_lib_dis_init) are added to the pattern,
+ * even if they are initialized later.
+ * 
+ * On failure DMA is stopped and ADC1 channels are read directly.
+ * 
+ * @param config        ADC1 configuration
+ * @param channel_freq  Conversions per second of each channel
+ * 
+ * @return ESP_OK on success
+ */
+esp_err_t adc_lib_dma_init(adc1_config_t *config, uint32_t channel_freq);
+
+/**
+ * @brief Check if ADC1 is sampled with DMA
+ * 
+ * Turns false if DMA couldn't be (re)started, e.g. when
+ * adc_lib_dis_init() added its channels.
+ * 
+ * @return "1" if ADC1 values come from DMA
+ */
+bool adc_lib_dma_running(void);
+
+/**
+ * @brief Read block of DMA conversions
+ * 
+ * Blocks until a DMA frame is available or timeout passes.
+ * 
+ * @param samples       Array for conversions
+ * @param max_samples   Size of "samples"
+ * @param timeout_ms    Longest wait in ms
+ * 
+ * @return Number of conversions read
+ */
+int adc_lib_dma_read(adc_lib_sample_t *samples, int max_samples, uint32_t timeout_ms);
+
 #endif // ADC_LIB_H
\ No newline at end of file
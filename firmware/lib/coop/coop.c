@@ -13,15 +13,30 @@ static int adc_results[CHANNEL_NUM];
 int coop_direction;
 
 static bool obstacle_detected;
+static hwtimer_job_t timer_dis;
 
 static void timer2_callback() {
 
+    #if ADC_LIB_DMA
+    // DMA values are a few ms old, LED is kept on until next period
+    static bool led_on = 0;
+
+    if (!led_on) {
+        multiple_led_drive(led_dis_pins, led_size, 1);
+        led_on = 1;
+        return;
+    }
+    adc_lib_dis_read_all(dis_results);
+    multiple_led_drive(led_dis_pins, led_size, 0);
+    led_on = 0;
+    #else
     multiple_led_drive(led_dis_pins, led_size, 1);
     adc_lib_dis_read_all(dis_results);  // dummy read
     adc_lib_dis_read_all(dis_results);  // dummy read
     adc_lib_dis_read_all(dis_results);
     // vTaskDelay(pdMS_TO_TICKS(1));
     multiple_led_drive(led_dis_pins, led_size, 0);
+    #endif
 
     if ((dis_results[0] >= DIS_THRESHOLD) &&(dis_results[1] >= DIS_THRESHOLD))  obstacle_detected = 1;
     else obstacle_detected = 0;    
@@ -44,7 +59,8 @@ void coop_dis_init(adc1_channel_t *adc1_ch, int a1_size, gpio_num_t *leds, int l
     adc_lib_dis_init(&adc_dis_config);
 
     multiple_led_init(led_dis_pins, led_size);
-    hwtimer_init(TIMER_DIS, TIMER_DIS_RESOLUTION, DIS_PERIOD, timer2_callback);
+    hwtimer_job_init(&timer_dis, timer2_callback);
+    hwtimer_job_start(&timer_dis, DIS_PERIOD_US, DIS_PERIOD_US);
 
 }
 
@@ -69,23 +85,74 @@ int coop_signal_direction(int adc_values[CHANNEL_NUM]) {
     return max_index;
 }
 
-void coop_turn_to_signal(int direction){
+coop_bearing_t coop_signal_bearing(const int adc_values[CHANNEL_NUM]) {
+    static const int16_t rx_angle[CHANNEL_NUM] = COOP_RX_ANGLE_DEG;
+    static const uint16_t rx_gain[CHANNEL_NUM] = COOP_RX_GAIN_Q8;
+    static const uint8_t response[COOP_BEARING_LUT_LEN] = COOP_BEARING_RESPONSE;
+    coop_bearing_t bearing = {0, 0};
+    int32_t a[CHANNEL_NUM];
+    int k = 0;
 
-    if (direction == 0) return;
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        a[i] = (adc_values[i] > 0) ? (adc_values[i] * rx_gain[i]) >> 8 : 0;
+        if (a[i] > a[k]) k = i;
+    }
+    if (a[k] < SIG_THRESHOLD) return bearing;
+
+    // Stronger neighbour decides side, their ratio (Q8) how far from strongest receiver
+    int left = (k + CHANNEL_NUM - 1) % CHANNEL_NUM;
+    int right = (k + 1) % CHANNEL_NUM;
+    int side = (a[right] >= a[left]) ? right : left;
+    int32_t ratio = (a[side] << 8) / a[k];
+    int idx = ratio >> 5;
+    int32_t offset = response[idx];
+    if (idx < COOP_BEARING_LUT_LEN - 1) offset += ((response[idx + 1] - response[idx]) * (ratio & 31)) >> 5;
+
+    int gap = (side == right) ? rx_angle[right] - rx_angle[k] : rx_angle[k] - rx_angle[left];
+    gap = (gap + 360) % 360;
+    int angle = rx_angle[k] + ((side == right) ? 1 : -1) * ((gap * offset) >> 8);
+    angle = ((angle % 360) + 360) % 360;
+    bearing.angle = (angle > 180) ? angle - 360 : angle;
+
+    // Signal from everywhere (reflections, ambient light) says little about direction
+    int32_t opposite = a[(k + CHANNEL_NUM / 2) % CHANNEL_NUM];
+    int32_t contrast = ((a[k] - opposite) * 255) / a[k];
+    int32_t strength = ((a[k] - SIG_THRESHOLD) * 255) / (COOP_BEARING_FULL_CONF - SIG_THRESHOLD);
+    if (strength > 255) strength = 255;
+    bearing.confidence = (contrast * strength) / 255;
+
+    return bearing;
+}
 
-    if (direction <= 3) servo_rotate_right(500);
-    if (direction > 3) servo_rotate_left(500);
-    vTaskDelay(pdMS_TO_TICKS(200));
-    servo_stop();
+void coop_steer_to_bearing(coop_bearing_t bearing, int speed) {
+    if (bearing.confidence < COOP_BEARING_MIN_CONF) {
+        servo_move_forward(speed);
+        return;
+    }
+
+    int turn = (bearing.angle * COOP_STEER_KP_Q4) >> 4;
+    if (turn > COOP_STEER_MAX_TURN) turn = COOP_STEER_MAX_TURN;
+    if (turn < -COOP_STEER_MAX_TURN) turn = -COOP_STEER_MAX_TURN;
+
+    if (abs(bearing.angle) > COOP_STEER_SPIN_DEG) servo_steer(0, turn);
+    else servo_steer(speed, turn);
 }
 
-void coop_turn_away(int direction){
-    if (direction == 3) return;
+bool coop_turn_to_signal(int direction){
 
-    if (direction > 3) servo_rotate_right(500);
-    if (direction < 3) servo_rotate_left(500);
-    vTaskDelay(pdMS_TO_TICKS(200));
-    servo_stop();
+    if (direction == 0) return false;
+    if (servo_motion_busy()) return false;  // Previous turn not done yet
+
+    if (direction <= 3) return servo_motion_segment(SERVO_MOTION_ROTATE_RIGHT, 500, 200);
+    return servo_motion_segment(SERVO_MOTION_ROTATE_LEFT, 500, 200);
+}
+
+bool coop_turn_away(int direction){
+    if (direction == 3) return false;
+    if (servo_motion_busy()) return false;
+
+    if (direction > 3) return servo_motion_segment(SERVO_MOTION_ROTATE_RIGHT, 500, 200);
+    return servo_motion_segment(SERVO_MOTION_ROTATE_LEFT, 500, 200);
 }
 
 
@@ -219,8 +286,8 @@ void coop_spread_out_loop(uint32_t time_now, bool flag_close) {
             break;
 
         case STATE_REVERSE:
-            servo_rotate_right_91();
-            servo_rotate_right_91();
+            // Direct movement is ignored till the turn is done
+            servo_motion_rotate_by(2 * 91);
             current_state = STATE_FORWARD_2;
             state_start_time = time_now;
             
@@ -244,10 +311,15 @@ void coop_spread_out_loop(uint32_t time_now, bool flag_close) {
             dm_comm_get_signals(adc_results);
             coop_direction = coop_signal_direction(adc_results);
             //printf("\n%lld \tCOOP: Direction: %d\n",time_now, coop_direction);
-            coop_turn_to_signal(coop_direction);
-
-            if (flag_close) servo_stop();
-            else servo_move_forward(SERVO_MOVE_SPEED);
+            if (coop_turn_to_signal(coop_direction)) {
+                // Queued after the turn
+                if (flag_close) servo_motion_segment(SERVO_MOTION_STOP, 0, 0);
+                else servo_motion_segment(SERVO_MOTION_FORWARD, SERVO_MOVE_SPEED, 0);
+            } else {
+                // Ignored while turning
+                if (flag_close) servo_stop();
+                else servo_move_forward(SERVO_MOVE_SPEED);
+            }
 
             break;
     }
@@ -261,6 +333,19 @@ uint8_t coop_get_state(){
 
 // ----------   CHAIN FORMATION   ------------
 
+// Max of two signals over a number of reads
+static void chain_signal_max(int samples, int ch_a, int *max_a, int ch_b, int *max_b) {
+    *max_a = 0;
+    *max_b = 0;
+    for (int i = 0; i <= samples; i++) {
+        dm_comm_get_signals(adc_results);
+
+        // Track max values over time
+        if (adc_results[ch_a] > *max_a) *max_a = adc_results[ch_a];
+        if (adc_results[ch_b] > *max_b) *max_b = adc_results[ch_b];
+    }
+}
+
 
 void state_chain() {
     static uint8_t role_id = ID_UNKNOWN;
@@ -268,13 +353,16 @@ void state_chain() {
     static int signal_front = 0, signal_back = 0;
     static bool cooldown_active = true;
     static int msg_count = 0;
+    static chain_move_t move_step = CHAIN_STAY;
+    static uint32_t move_id = 0;       // Last queued segment of a step
 
-    static uint32_t time_now = 0;
-    static uint32_t timer_command = 0;
+    static uint32_t time_now = 0;       // ms
+    static uint32_t timer_command = 0;  // BIT_DURATION_US periods
+    static hwtimer_stopwatch_t role_clock, beacon_clock;
 
 
-    time_now = hwtimer_get_time();
-    timer_command = hwtimer_cmd_get_time();
+    time_now = hwtimer_stopwatch_elapsed_us(&role_clock) / 1000;
+    timer_command = hwtimer_stopwatch_elapsed_us(&beacon_clock) / BIT_DURATION_US;
 
     if ((role_id == ID_BACK) && (cooldown_active) && (time_now >= COOLDOWN_AFTER_MOVE)) cooldown_active = false;
     
@@ -283,9 +371,12 @@ void state_chain() {
     if (dm_comm_process()) {
         dm_comm_get_messages(rx_msg);
 
-        if (rx_msg[0] == MSG_PRESENCE_BEACON) signal_front++;
-        if (rx_msg[3] == MSG_PRESENCE_BEACON) signal_back++;
-        msg_count++;
+        // Role doesn't change while moving up
+        if (move_step == CHAIN_STAY) {
+            if (rx_msg[0] == MSG_PRESENCE_BEACON) signal_front++;
+            if (rx_msg[3] == MSG_PRESENCE_BEACON) signal_back++;
+            msg_count++;
+        }
         //printf("\nfront: %d    back: %d", signal_front, signal_back);
         vTaskDelay(pdMS_TO_TICKS(1));
     }
@@ -303,7 +394,7 @@ void state_chain() {
             if (role_id != ID_BACK) {
                 role_id = ID_BACK;
                 cooldown_active = true;
-                hwtimer_reset_clock();
+                hwtimer_stopwatch_start(&role_clock);
                 time_now = 0;
                 printf("\n→ Role: BACK");
             }
@@ -328,143 +419,74 @@ void state_chain() {
     // Broadcast role
     if (timer_command >= MSG_INTERVAL) {
         dm_comm_send(MSG_PRESENCE_BEACON);
-        hwtimer_cmd_reset_clock();
+        hwtimer_stopwatch_start(&beacon_clock);
         timer_command = 0;
     }
 
-    // Move if in the back
-    if ((role_id == ID_BACK) && !cooldown_active) {
-
-        printf("\nMoving up");
-
-        // Get out of line
-        servo_rotate_right_91();
-        servo_move_forward(300);
-        vTaskDelay(pdMS_TO_TICKS(CHAIN_FORWARD_ROTATE_MS));
-        servo_rotate_left_91();
-
-        // Moving in parallel of line
-        servo_move_forward(300);
-        vTaskDelay(pdMS_TO_TICKS(CHAIN_FORWARD_TIME_MS));
-        
-        // %%%%%%% Blindly align in front of line %%%%%%%%%
-
-        // // Get in line
-        // servo_rotate_left_91();
-        // servo_move_forward(300);
-        // vTaskDelay(pdMS_TO_TICKS(CHAIN_FORWARD_ROTATE_MS));
-        // servo_rotate_right_91();
-
-        // servo_stop();
-
-        // role_id = ID_FRONT;
-        // hwtimer_cmd_reset_clock();
-        // timer_command = 0;
-        // printf("\nMoved: BACK → FRONT");
-
-
-
-
-        // %%%%%%% Dynamically align in front of line, but NOT WORKING %%%%%%%%%
-
-        // Check if at the front of line
-        int back_left_max = 0, front_left_max = 0;
-        bool far_enough = 0;
-
-        servo_move_forward(300);
-        while (!far_enough){
-            back_left_max = 0;
-            front_left_max = 0;
-            for (int i = 0; i <= SIGNAL_SAMPLE_COUNT; i++) {
-                dm_comm_get_signals(adc_results);
-
-                // Track max values over time
-                if (adc_results[4] > back_left_max) back_left_max = adc_results[4];     // BACK_LEFT
-                if (adc_results[5] > front_left_max) front_left_max = adc_results[5];   // FRONT_LEFT
-            }
-
-            if (back_left_max >= (front_left_max + 100)) far_enough = 1;
-        }
-
-        // not working properly
-
-        // // Rotate to go back in line
-        // bool rotate_back_enough = 0;
-
-        // servo_rotate_left(100);
-        // while (!rotate_back_enough){
-        //     back_left_max = 0;
-        //     front_left_max = 0;
-        //     for (int i = 0; i <= SIGNAL_SAMPLE_COUNT; i++) {
-        //         dm_comm_get_signals(adc_results);
+    // Move if in the back, one step per call so frames and beacons keep going
+    int back_left_max = 0, front_left_max = 0, back_max = 0;
+
+    switch (move_step) {
+        case CHAIN_STAY:
+            if ((role_id != ID_BACK) || cooldown_active) break;
+            printf("\nMoving up");
+
+            // Get out of line, move in parallel of line
+            servo_motion_rotate_by(91);
+            servo_motion_segment(SERVO_MOTION_FORWARD, 300, CHAIN_FORWARD_ROTATE_MS);
+            servo_motion_rotate_by(-91);
+            servo_motion_segment(SERVO_MOTION_FORWARD, 300, CHAIN_FORWARD_TIME_MS);
+            move_id = servo_motion_segment(SERVO_MOTION_FORWARD, 300, 0);
+            move_step = CHAIN_MOVE_OUT;
+            break;
 
-        //         // Track max values over time
-        //         if (adc_results[4] > back_left_max) back_left_max = adc_results[4];     // BACK_LEFT
-        //         if (adc_results[5] > front_left_max) front_left_max = adc_results[5];   // FRONT_LEFT
-        //     }           
-            
-        //     if (front_left_max >= (back_left_max + 10)) rotate_back_enough = 1;
-        // }
+        case CHAIN_MOVE_OUT:
+            if (servo_motion_done(move_id)) move_step = CHAIN_FIND_FRONT;
+            break;
 
-        vTaskDelay(pdMS_TO_TICKS(500));
-        servo_rotate_left_91();
+        case CHAIN_FIND_FRONT:
+            // Check if at the front of line
+            chain_signal_max(SIGNAL_SAMPLE_COUNT, 4, &back_left_max, 5, &front_left_max);   // BACK_LEFT, FRONT_LEFT
+            if (back_left_max < (front_left_max + 100)) break;
 
-        // Go in front of front robot
-        far_enough = 0;
-        
-        servo_move_forward(300);
-        hwtimer_reset_clock();
-        time_now = 0;
-        // vTaskDelay(pdMS_TO_TICKS(CHAIN_FORWARD_ROTATE_MS));
-        while (!far_enough){
-            time_now = hwtimer_get_time();
-
-            back_left_max = 0;
-            front_left_max = 0;
-            for (int i = 0; i <= 20; i++) {
-                dm_comm_get_signals(adc_results);
-
-                // Track max values over time
-                if (adc_results[4] > back_left_max) back_left_max = adc_results[4];     // BACK_LEFT
-                if (adc_results[5] > front_left_max) front_left_max = adc_results[5];   // FRONT_LEFT
-            }
+            // A bit further, then rotate to go back in line
+            servo_motion_segment(SERVO_MOTION_FORWARD, 300, 500);
+            servo_motion_rotate_by(-91);
+            move_id = servo_motion_segment(SERVO_MOTION_FORWARD, 300, 0);
+            move_step = CHAIN_TURN_IN;
+            break;
 
-            if ((abs(back_left_max - front_left_max) <= 50) && (time_now >= CHAIN_FORWARD_ROTATE_MS-500)) far_enough = 1;
-            if (time_now >= CHAIN_FORWARD_ROTATE_MS+500) far_enough = 1;
-        }
+        case CHAIN_TURN_IN:
+            if (!servo_motion_done(move_id)) break;
+            hwtimer_stopwatch_start(&role_clock);
+            move_step = CHAIN_PASS_FRONT;
+            break;
 
-        // Align
-        back_left_max = 0;
-        int back_max = 0;
-        bool rotate_enough = 0;
-        hwtimer_reset_clock();
-        time_now = 0;
-
-        servo_rotate_right(100);
-        while (!rotate_enough){
-            time_now = hwtimer_get_time();
-
-            back_left_max = 0;
-            back_max = 0;
-            for (int i = 0; i <= SIGNAL_SAMPLE_COUNT-30; i++) {
-                dm_comm_get_signals(adc_results);
-
-                // Track max values over time
-                if (adc_results[4] > back_left_max) back_left_max = adc_results[4];     // BACK_LEFT
-                if (adc_results[3] > back_max) back_max = adc_results[3];   // BACK
-            }           
-            
-            if ((back_max >= (back_left_max + 1000)) && (time_now >= SERVO_ROTATE_RIGHT-100)) rotate_enough = 1;
-            if (time_now >= SERVO_ROTATE_RIGHT+100) rotate_enough = 1;
-        }
+        case CHAIN_PASS_FRONT:
+            // Go in front of front robot
+            chain_signal_max(20, 4, &back_left_max, 5, &front_left_max);
+            if (!((abs(back_left_max - front_left_max) <= 50) && (time_now >= CHAIN_FORWARD_ROTATE_MS-500)) &&
+                (time_now < CHAIN_FORWARD_ROTATE_MS+500)) break;
 
-        servo_stop();
+            // Align
+            hwtimer_stopwatch_start(&role_clock);
+            servo_rotate_right(100);
+            move_step = CHAIN_ALIGN;
+            break;
 
-        role_id = ID_FRONT;
-        hwtimer_cmd_reset_clock();
-        timer_command = 0;
-        printf("\nMoved: BACK → FRONT");
+        case CHAIN_ALIGN:
+            chain_signal_max(SIGNAL_SAMPLE_COUNT-30, 4, &back_left_max, 3, &back_max);      // BACK_LEFT, BACK
+            if (!((back_max >= (back_left_max + 1000)) && (time_now >= SERVO_ROTATE_RIGHT-100)) &&
+                (time_now < SERVO_ROTATE_RIGHT+100)) break;
+
+            servo_stop();
+            role_id = ID_FRONT;
+            hwtimer_stopwatch_start(&beacon_clock);
+            timer_command = 0;
+            printf("\nMoved: BACK → FRONT");
+            move_step = CHAIN_STAY;
+            break;
     }
 
-    servo_stop();
+    if (move_step == CHAIN_STAY) servo_stop();
 }
\ No newline at end of file
@@ -13,6 +13,9 @@
 #ifndef COOP_H
 #define COOP_H
 
+// C/C++ libraries
+#include <stdlib.h>
+
 // ESP-IDF libraries
 #include "freertos/FreeRTOS.h"
 #include "esp_random.h"
@@ -25,13 +28,21 @@
 #include "servo_driver.h"
 #include "dm_comm.h"
 
-#define TIMER_DIS 2         // Timer for periodically detecting obstacle
-#define TIMER_DIS_RESOLUTION    10000  // Timer resolution in Hz
-#define DIS_PERIOD 300         // With resolution 10000 Hz, 300 corresponds to 30ms
+#define DIS_PERIOD_US 30000    // Period of obstacle detection (job of timer wheel)
 #define DIS_THRESHOLD 4000     // Threshold for deciding presence of obstacle 
 
 #define SERVO_MOVE_SPEED 300
 
+// Bearing from all receivers (coop_signal_bearing), calibration is in io_define.h
+#define COOP_BEARING_LUT_LEN    9       // Entries of COOP_BEARING_RESPONSE
+#define COOP_BEARING_FULL_CONF  3000    // Strongest receiver above this gives full confidence
+#define COOP_BEARING_MIN_CONF   32      // Lower confidence is not used for steering
+
+// Proportional steering (coop_steer_to_bearing)
+#define COOP_STEER_KP_Q4        64      // Turn speed per degree of bearing (16 = 1)
+#define COOP_STEER_MAX_TURN     300
+#define COOP_STEER_SPIN_DEG     60      // Larger bearing is corrected by rotating in place
+
 
 //----------    RANDOM WALK     ----------
 
@@ -51,6 +62,13 @@ typedef enum {
 } move_type_t;
 
 
+// Direction of signal
+typedef struct {
+    int16_t angle;          // Degrees, -179 to 180, clockwise from front (positive is right)
+    uint8_t confidence;     // 0 (no signal) to 255
+} coop_bearing_t;
+
+
 // ----------   CMD2 - SPREAD OUT   ------------
 
 // Define durations in microseconds
@@ -83,6 +101,16 @@ typedef enum {
 #define ID_MIDDLE   2
 #define ID_BACK     3
 
+// Steps of moving up from the back of line
+typedef enum {
+    CHAIN_STAY,
+    CHAIN_MOVE_OUT,         // Out of line and along it (queued)
+    CHAIN_FIND_FRONT,       // Forward till the front robot is behind
+    CHAIN_TURN_IN,          // Turn back to line (queued)
+    CHAIN_PASS_FRONT,       // Forward in front of the front robot
+    CHAIN_ALIGN,            // Rotate till back faces the line
+} chain_move_t;
+
 
 /**
  * @brief Initialize obstacle detection (ADC and LEDs)
@@ -111,21 +139,56 @@ bool coop_obstacle_detection(void);
  */
 int coop_signal_direction(int adc_values[CHANNEL_NUM]);
 
+/**
+ * @brief Get bearing of signal
+ * 
+ * Values are corrected by gains of receivers and angle is interpolated
+ * between the strongest receiver and its stronger neighbour with
+ * calibrated response table (fixed-point). Confidence is lower for weak
+ * signal and for signal which is strong on the opposite side too.
+ * 
+ * @param adc_values Read values (or amplitudes of frame)
+ * 
+ * @return Returns angle and confidence
+ */
+coop_bearing_t coop_signal_bearing(const int adc_values[CHANNEL_NUM]);
+
+/**
+ * @brief Steer proportionally to bearing
+ * 
+ * Doesn't block, sets speed of servomotors and returns. Bearing
+ * larger than COOP_STEER_SPIN_DEG is corrected by rotating in place,
+ * with too low confidence the robot goes straight.
+ * 
+ * @param bearing   Bearing of signal
+ * @param speed     Forward speed
+ * 
+ */
+void coop_steer_to_bearing(coop_bearing_t bearing, int speed);
+
 /**
  * @brief Turn to chosen direction (usually strongest)
  * 
+ * Short turn is queued to motion queue, doesn't block.
+ * Does nothing while queued motion still runs.
+ * 
  * @param direction     Chosen direction
  * 
+ * @return true if turn was queued
  */
-void coop_turn_to_signal(int direction);
+bool coop_turn_to_signal(int direction);
 
 /**
  * @brief Turn away from chosen direction (usually strongest)
  * 
+ * Short turn is queued to motion queue, doesn't block.
+ * Does nothing while queued motion still runs.
+ * 
  * @param direction     Chosen direction
  * 
+ * @return true if turn was queued
  */
-void coop_turn_away(int direction);
+bool coop_turn_away(int direction);
 
 
 /**
@@ -1,6 +1,10 @@
 #include "dm_comm.h"
 
-static int timer_comm = 1;
+#if DM_OWN_TIMER
+static int timer_comm = DM_TIMER_ID;  // Own gptimer, DM_TICK_US is finer than wheel tick
+#else
+static hwtimer_job_t timer_comm;      // Job of timer wheel, every DM_TICK_US
+#endif
 
 // timing
 static long long int time1_last;
@@ -16,178 +20,1296 @@ static int led_size;
 static int adc1_results[2];
 static int adc2_results[4];
 
-static int rx_buffer[CHANNEL_NUM] = {0};
 static int msg[CHANNEL_NUM] = {0};
-static int tx_buffer;
+static int msg_strength[CHANNEL_NUM] = {0};     // Mean amplitude of last frame on each channel
+
+// Receive decoder of one channel, advanced by one half-bit in timer interrupt
+typedef enum {
+    DM_RX_HUNT,         // Looking for START_SIG
+    DM_RX_RATE,         // Rate field
+    DM_RX_DATA,         // Coded bytes of frame
+} dm_rx_state_t;
+
+typedef struct {
+    dm_rx_state_t state;
+    uint16_t shift;                     // Last half-bits, newest in bit 0
+    uint8_t half;                       // Half-bits received in current field/byte
+    uint8_t rate;
+    uint8_t fec;                        // Frame is sent with FEC (flag in rate field)
+    uint8_t coded[DM_FEC_RATIO];        // Sent bytes of current frame byte
+    uint8_t n_bytes;                    // Decoded frame bytes
+    uint8_t expected;                   // Frame bytes, known after length byte
+    uint8_t crc;                        // CRC of decoded bytes (without CRC byte)
+    uint8_t bytes[DM_MAX_FRAME_BYTES];
+    uint16_t peak;                      // Highest sample since START_SIG
+    uint32_t amp_sum;                   // Sum and number of HIGH samples since START_SIG
+    uint16_t amp_n;
+} dm_rx_t;
+
+static dm_rx_t rx_dec[CHANNEL_NUM];
+
+// Slicing threshold of one channel (DM_ADAPTIVE_THRESHOLD)
+typedef struct {
+    int32_t floor;          // Noise floor (DM_LEVEL_FRAC fixed point)
+    int32_t peak;           // Signal peak (DM_LEVEL_FRAC fixed point)
+    int16_t threshold;      // Lowest sample read as HIGH
+} dm_slicer_t;
+
+static dm_slicer_t rx_slicer[CHANNEL_NUM];
+
+#if DM_CARRIER
+// Last samples of one channel for carrier demodulation
+typedef struct {
+    int16_t x[DM_CARRIER_TICKS];
+    uint8_t n;              // Next sample is stored here
+    uint8_t fill;           // Samples since reset, amplitude is valid after DM_CARRIER_TICKS
+} dm_demod_t;
+
+static dm_demod_t rx_demod[CHANNEL_NUM];
+static uint8_t carrier_tick = 0;    // Carrier phase of own LEDs
+#endif
+
+// Received frames, filled in timer interrupt (one producer and one consumer per channel)
+typedef struct {
+    dm_frame_t frames[DM_RX_QUEUE_LEN];
+    uint8_t head;           // Written only by timer interrupt (rx_dma_task() for ADC1 with DMA)
+    uint8_t tail;           // Written only by reading task
+    uint32_t dropped;       // Frames lost because queue was full
+} dm_rx_queue_t;
+
+static dm_rx_queue_t rx_queue[CHANNEL_NUM];
+static dm_channel_stats_t rx_stats[CHANNEL_NUM];    // Written only by decoder of the channel, producer side like rx_queue head
+static uint8_t rx_next_channel = 0;             // Channel read first by dm_comm_recv_frame()
+static TaskHandle_t volatile rx_waiter = NULL;  // Task blocked in dm_comm_wait_frame()
+
+// Sequence numbers already returned by dm_comm_recv_frame(), per sender
+typedef struct {
+    uint8_t seq[DM_DEDUP_DEPTH];
+    uint8_t next;           // Oldest entry, replaced next
+    uint8_t count;          // Valid entries
+    int64_t last_heard;
+} dm_seen_t;
+
+static dm_seen_t rx_seen[DM_MAX_ROBOTS];
+static dm_seen_t proc_seen[CHANNEL_NUM][DM_MAX_ROBOTS];     // Same for dm_comm_process(), each channel separately
+static uint32_t rx_duplicates = 0;
+
+// Received broadcast frames waiting to be sent again (relay)
+typedef struct {
+    dm_frame_t frame;       // TTL and hops already changed
+    uint16_t delay;         // Ticks left before it can be sent
+} dm_relay_t;
+
+static dm_relay_t relay_queue[DM_RELAY_QUEUE_LEN];
+static uint8_t relay_len = 0;
+static dm_seen_t relay_seen[DM_MAX_ROBOTS];     // Frames already relayed, per sender
+static bool tx_relaying = 0;                    // tx_data holds relayed frame, not one from dm_comm_send_frame()
+
+// Relay counters (written under tx_lock like CSMA and ACK counters)
+static uint32_t relay_sent = 0;
+static uint32_t relay_suppressed = 0;
+static uint32_t relay_dropped = 0;
+
+// Frame being sent (half-bits after START_SIG)
+typedef struct {
+    uint16_t levels[DM_MAX_CODED_BYTES];    // Half-bits of coded bytes (MSB first), from LOW level
+    uint8_t rate_levels;    // Half-bits of rate field
+    uint8_t flip;           // Rate field ends HIGH, levels are inverted
+    uint16_t half_bits;     // Half-bits after START_SIG
+    uint8_t rate;
+    uint8_t fec;            // Coded bytes are FEC codewords (flag in rate field)
+    uint16_t ticks;         // Timer ticks of whole frame
+} dm_tx_buf_t;
+
+static dm_tx_buf_t tx_data;                     // Frame from dm_comm_send_frame()
+static dm_tx_buf_t tx_beacon;                   // TDMA beacon, sent from timer interrupt
+static dm_tx_buf_t tx_ack;                      // ACK of received frame, sent from timer interrupt
+static dm_tx_buf_t *tx_cur = &tx_data;
+static portMUX_TYPE tx_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Acknowledgement of tx_data (unicast frames)
+static uint8_t tx_dst;                          // Destination of tx_data
+static uint8_t tx_seq;                          // Sequence number of tx_data
+static bool tx_ack_req = 0;                     // tx_data waits for ACK after sending
+static bool tx_wait_ack = 0;                    // tx_data was sent, ACK not received yet
+static uint16_t ack_timer = 0;                  // Ticks left to wait for ACK
+static uint8_t ack_sifs = 0;                    // Ticks left before sending ACK
+static uint8_t ack_retries = 0;                 // Retransmissions of tx_data
+static volatile dm_tx_status_t tx_status = DM_TX_IDLE;
+
+// ACK counters
+static uint32_t ack_retransmits = 0;
+static uint32_t ack_failed = 0;
+
+static uint32_t tx_frames = 0;                  // Frames sent to the end
+
+#if DM_TX_RMT
+// RMT transmitter, one channel per LED
+static rmt_channel_handle_t rmt_channels[DM_RMT_MAX_LEDS];
+static rmt_encoder_handle_t rmt_encoders[DM_RMT_MAX_LEDS];
+static rmt_sync_manager_handle_t rmt_sync = NULL;
+static int rmt_count = 0;
+static TaskHandle_t rmt_task = NULL;
+static bool rmt_led_level = 0;      // Level left by dm_comm_led_drive(), frames end with LOW
+#endif
 
 // Flags
-static uint8_t tx_bit_index;
-static uint8_t sending = 0;
+static uint16_t tx_bit_index;
+static volatile uint8_t sending = 0;
 static uint8_t reading = 1;
 static uint8_t read_flag;
-
-static uint8_t rx_count[CHANNEL_NUM] = {0};
-static bool start_detected[CHANNEL_NUM] = {0};
+static bool reading_stop_due = 0;               // Reading stops when nothing is left to send (under tx_lock)
+
+static volatile bool start_flag = 0;            // START_SIG detected since last dm_comm_detect_start_sig()
+
+// Clock recovery (per channel sampling window)
+typedef struct {
+    uint8_t phase;      // Sample index in current half-bit window
+    uint8_t samples;    // Number of samples in window (moves with phase)
+    uint8_t votes;      // Number of HIGH samples in window
+    uint8_t center;     // Sample in the middle of window (used on tie)
+    uint8_t last;       // Previous sample (for edge detection)
+    uint8_t n;          // Samples per half-bit (depends on rate)
+} dm_clock_t;
+
+static dm_clock_t rx_clock[CHANNEL_NUM];
+static uint8_t tx_tick = 0;
+static uint8_t tx_level = 0;    // LED level of current half-bit
+static uint8_t tx_ticks = DM_OVERSAMPLE;        // Timer ticks of current half-bit
+
+static const uint8_t dm_rate_ticks[DM_RATE_COUNT] = DM_RATE_TICKS;
+
+// Bit rate towards each robot
+typedef struct {
+    uint8_t rate;
+    uint8_t streak;         // Successes since last rate change
+    int64_t last_heard;     // Time of last received frame (us)
+    // Amplitude of last frame from this robot on every channel (0 if channel didn't decode it)
+    uint16_t peak[CHANNEL_NUM];
+    uint16_t mean[CHANNEL_NUM];
+    uint8_t strength_seq;
+    int64_t strength_time;
+} dm_link_t;
+
+static dm_link_t links[DM_MAX_ROBOTS];
+static portMUX_TYPE link_lock = portMUX_INITIALIZER_UNLOCKED;
 
 // Flags for CSMA/CA
-static uint8_t channel_occupied = 0;  // Flag for busy channel
-static uint8_t backoff_active = 0;    // Flag for backoff state
-static int backoff_countdown = 0;     // Backoff time (random)
+static bool rx_carrier = 0;             // HIGH sample on any channel in this tick
+#if ADC_LIB_DMA
+static volatile bool rx_dma_carrier = 0;    // HIGH sample on ADC1 channel in last DMA batch
+#endif
+static bool tx_on_air = 0;              // Frame is being sent ("sending" is set while waiting too)
+static bool tx_deferred = 0;            // Frame found channel busy
+static uint8_t send_flag = 0;           // START_SIG was sent, data follows
+static uint16_t csma_idle_ticks = 0;    // Ticks since channel was last busy
+static uint8_t csma_slot_tick = 0;
+static uint16_t csma_backoff = 0;       // Backoff slots left
+static uint16_t csma_cw = DM_CSMA_CW_MIN;   // Contention window (slots)
+static uint8_t csma_attempts = 0;       // Collisions of current frame
+static uint32_t csma_wait_ticks = 0;    // Time frame is waiting for channel
+static uint8_t tx_low_ticks = 0;        // Ticks since own LED went LOW
+static uint8_t tx_collision_samples = 0;
+
+static uint8_t backoff_active = 0;    // Flag for backoff state (dm_comm_set_backoff)
+static int backoff_countdown = 0;     // Backoff time (timer ticks)
+
+#if DM_TDMA
+// TDMA superframe
+static uint16_t tdma_tick = 0;                  // Ticks since start of superframe
+static bool tdma_master = 0;                    // Robot sends beacons
+static uint8_t tdma_missed = DM_TDMA_SYNC_LOST; // Superframes without beacon
+static bool tdma_beacon_due = 0;                // Beacon waits for ACK or frame on air
+#endif
+
+// CSMA counters
+static uint32_t csma_deferrals = 0;
+static uint32_t csma_collisions = 0;
+static uint32_t csma_dropped = 0;
+
+// Signal snapshots for coop.h, written by sense_task() only
+static int sense_buf[2][CHANNEL_NUM];
+static uint32_t sense_seq = 0;          // sense_buf[sense_seq & 1] is the newest complete one
+static TaskHandle_t sense_handle = NULL;
+static TaskHandle_t sense_waiter = NULL;    // Task in sense_wait(), notified by sense_task()
+
+static void rx_frame_done(int i);
+static bool rx_queue_pop(dm_rx_queue_t *q, dm_frame_t *frame);
+
+#if DM_FEC == DM_FEC_HAMMING
+// Extended Hamming(8,4) codewords: d1 d2 d3 d4 p1 p2 p3 p0
+static const uint8_t hamming_encode[16] = {
+    0x00, 0x1E, 0x2D, 0x33, 0x4B, 0x55, 0x66, 0x78,
+    0x87, 0x99, 0xAA, 0xB4, 0xCC, 0xD2, 0xE1, 0xFF
+};
+
+#define HAMMING_CORRECTED   0x10
+#define HAMMING_FAILED      0x20
+
+// Received byte -> nibble | flags, filled in dm_comm_init()
+static uint8_t hamming_decode[256];
+
+static void hamming_init(void) {
+    for (int rx = 0; rx < 256; rx++) {
+        hamming_decode[rx] = HAMMING_FAILED;
+        for (int n = 0; n < 16; n++) {
+            int dist = __builtin_popcount(rx ^ hamming_encode[n]);
+            if (dist == 0) {
+                hamming_decode[rx] = n;
+                break;
+            }
+            if (dist == 1) hamming_decode[rx] = n | HAMMING_CORRECTED;
+        }
+    }
+}
+#endif
+
+// Differential Manchester, filled in dm_comm_init()
+static uint16_t dm_encode_table[256];   // Byte -> 16 half-bits (MSB first) after LOW half-bit
+static uint8_t dm_decode_table[512];    // Previous half-bit and 8 half-bits -> 4 bits
+
+static void dm_table_init(void) {
+    for (int b = 0; b < 256; b++) {
+        uint8_t level = 0;
+        uint16_t pattern = 0;
+        for (int k = 7; k >= 0; k--) {
+            if (!((b >> k) & 1)) level = !level;    // "0" has transition at the start of bit
+            pattern = (pattern << 1) | level;
+            level = !level;                         // Every bit has transition in the middle
+            pattern = (pattern << 1) | level;
+        }
+        dm_encode_table[b] = pattern;
+    }
 
-// Array for coop.h
-static int sig_adc1_results[2];
-static int sig_adc2_results[4];
+    for (int x = 0; x < 512; x++) {
+        uint8_t bits = 0;
+        for (int k = 0; k < 4; k++) {
+            uint8_t before = (x >> (8 - 2 * k)) & 1;
+            uint8_t first = (x >> (7 - 2 * k)) & 1;
+            bits = (bits << 1) | (first == before);
+        }
+        dm_decode_table[x] = bits;
+    }
+}
 
+// Frame bytes -> sent bytes
+static void fec_encode(const uint8_t *in, uint8_t *out, int n_bytes, bool fec) {
+    #if DM_FEC == DM_FEC_HAMMING
+    if (fec) {
+        for (int i = 0; i < n_bytes; i++) {
+            out[2 * i] = hamming_encode[in[i] >> 4];
+            out[2 * i + 1] = hamming_encode[in[i] & 0x0F];
+        }
+        return;
+    }
+    #endif
+    memcpy(out, in, n_bytes);
+}
 
-static void timer1_callback() {
+// Received bytes -> frame bytes, returns false if not correctable (counted by caller)
+static bool fec_decode(const uint8_t *in, uint8_t *out, int n_bytes, bool fec, dm_channel_stats_t *stats) {
+    #if DM_FEC == DM_FEC_HAMMING
+    if (fec) {
+        for (int i = 0; i < n_bytes; i++) {
+            uint8_t hi = hamming_decode[in[2 * i]];
+            uint8_t lo = hamming_decode[in[2 * i + 1]];
+            if ((hi | lo) & HAMMING_FAILED) return false;
+            stats->fec_corrected += ((hi & HAMMING_CORRECTED) != 0) + ((lo & HAMMING_CORRECTED) != 0);
+            out[i] = ((hi & 0x0F) << 4) | (lo & 0x0F);
+        }
+        return true;
+    }
+    #endif
+    memcpy(out, in, n_bytes);
+    return true;
+}
 
-    #if WITH_LEADER
-        //#if !LEADER 
 
-        if(!reading) return;
-        
-        multiple_led_drive(led_pins, led_size, 0);
-        
-        if(reading){    
-            adc_lib_read_all_logical(adc1_results, adc2_results, rx_buffer, SIG_THRESHOLD);
-            
-            for (int i = 0; i < CHANNEL_NUM; i++) rx_count[i]++;
-            //rx_count++;
-        }
+static uint8_t crc8_update(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (int b = 0; b < 8; b++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ DM_CRC_POLY : (crc << 1);
+    }
+    return crc;
+}
 
-        //#else
-        
+static uint8_t crc8(const uint8_t *data, int len) {
+    uint8_t crc = 0;
+    for (int i = 0; i < len; i++) crc = crc8_update(crc, data[i]);
+    return crc;
+}
 
-        if (!sending) return;
+static void reset_channel(int i) {
+    rx_dec[i].state = DM_RX_HUNT;
+    rx_dec[i].shift = 0;
+    rx_dec[i].peak = 0;
+    rx_dec[i].amp_sum = 0;
+    rx_dec[i].amp_n = 0;
+    rx_clock[i].n = DM_OVERSAMPLE;
+}
 
-        static uint8_t current_level = 0;
-        static uint8_t send_flag = 0;
-        uint8_t bit;
+// Frame can't be received, sender is known if its ID was decoded
+static void rx_abort(int i) {
+    dm_rx_t *r = &rx_dec[i];
+    bool relayed = (r->n_bytes > 2) && (r->bytes[2] >> DM_HDR_HOPS_SHIFT);     // Sent by someone else
 
-        if ((tx_bit_index >= START_SIG_LEN) && !send_flag) {
-            send_flag = 1;
-            current_level = 0;
-            tx_bit_index = 0;
+    if ((r->rate > 0) && (r->n_bytes > 0) && !relayed) dm_comm_rate_report(r->bytes[0] >> DM_HDR_SRC_SHIFT, false);
+    reset_channel(i);
+}
+
+// Sample -> level, threshold moves with noise floor and peak of channel
+static uint8_t rx_slice(dm_slicer_t *t, int value) {
+    #if DM_ADAPTIVE_THRESHOLD
+    int32_t x = (int32_t)value << DM_LEVEL_FRAC;
+
+    t->floor += (x - t->floor) >> ((x < t->floor) ? DM_FLOOR_FALL_SHIFT : DM_FLOOR_RISE_SHIFT);
+    if (x > t->peak) t->peak += (x - t->peak) >> DM_PEAK_RISE_SHIFT;
+    else t->peak += (t->floor - t->peak) >> DM_PEAK_FALL_SHIFT;
+    if (t->peak < t->floor) t->peak = t->floor;
+
+    int32_t span = (t->peak - t->floor) >> DM_THRESHOLD_SHIFT;
+    if (span < ((int32_t)DM_THRESHOLD_MARGIN << DM_LEVEL_FRAC)) span = (int32_t)DM_THRESHOLD_MARGIN << DM_LEVEL_FRAC;
+    t->threshold = (t->floor + span) >> DM_LEVEL_FRAC;
+    #else
+    t->threshold = DM_RX_THRESHOLD;
+    #endif
+    return value >= t->threshold;
+}
+
+// Amplitude of frame is measured from samples which are already read for decoding
+static inline void rx_amp_add(dm_rx_t *r, int value, uint8_t sample) {
+    if ((r->state == DM_RX_HUNT) || !sample) return;
+    if (value > r->peak) r->peak = value;
+    r->amp_sum += value;
+    r->amp_n++;
+}
+
+#if DM_CARRIER
+// Carrier amplitude of last DM_CARRIER_TICKS samples (carrier is 2 ticks HIGH, 2 LOW),
+// x[n] - x[n-2] and x[n-1] - x[n-3] are in quadrature, so the sum doesn't depend on phase
+static int rx_demodulate(dm_demod_t *d, int value) {
+    d->x[d->n] = value;
+    int i = d->x[d->n] - d->x[(d->n + 2) % DM_CARRIER_TICKS];
+    int q = d->x[(d->n + 3) % DM_CARRIER_TICKS] - d->x[(d->n + 1) % DM_CARRIER_TICKS];
+    d->n = (d->n + 1) % DM_CARRIER_TICKS;
+
+    // Older samples are from before the channel was read again
+    if (d->fill < DM_CARRIER_TICKS) {
+        d->fill++;
+        return 0;
+    }
+    return (abs(i) + abs(q)) / 2;
+}
+#endif
+
+// Add received half-bit, decoder moves on by one step
+static void rx_push(int i, uint8_t level) {
+    dm_rx_t *r = &rx_dec[i];
+
+    r->shift = (r->shift << 1) | level;
+
+    switch (r->state) {
+    case DM_RX_HUNT:
+        // START_SIG after at least one LOW half-bit
+        if ((r->shift & DM_START_MASK) == START_SIG) {
+            rx_stats[i].start_sigs++;
+            r->state = DM_RX_RATE;
+            r->half = 0;
+            r->rate = 0;
+            start_flag = 1;
+        }
+        break;
+
+    case DM_RX_RATE:
+        if (++r->half == DM_RATE_LEN) {
+            // No transition at the start of bit -> "1", table takes 8 half-bits
+            uint8_t field = dm_decode_table[(r->shift & ((2 << DM_RATE_LEN) - 1)) << (8 - DM_RATE_LEN)] >> (4 - DM_RATE_LEN / 2);
+            #if DM_FEC == DM_FEC_HAMMING
+            r->rate = field >> 1;
+            r->fec = field & 1;
+            #else
+            r->rate = field;
+            r->fec = 0;
+            #endif
+            if (r->rate >= DM_RATE_COUNT) {
+                rx_stats[i].aborted++;
+                reset_channel(i);
+                break;
+            }
+            // Rest of frame is received with chosen rate
+            rx_clock[i].n = dm_rate_ticks[r->rate];
+            r->state = DM_RX_DATA;
+            r->half = 0;
+            r->n_bytes = 0;
+            r->expected = DM_FRAME_BYTES(0);
+            r->crc = 0;
         }
+        break;
+
+    case DM_RX_DATA:
+        if (++r->half % 8) break;
+
+        // 4 bits from last 8 half-bits (and the one before them)
+        uint8_t *coded = &r->coded[(r->half - 1) / 16];
+        *coded = (*coded << 4) | dm_decode_table[r->shift & 0x1FF];
+        if (r->half < (r->fec ? 16 * DM_FEC_RATIO : 16)) break;
+
+        // Whole frame byte is in
+        r->half = 0;
+        uint8_t byte;
+        if (!fec_decode(r->coded, &byte, 1, r->fec, &rx_stats[i])) {
+            rx_stats[i].fec_errors++;
+            rx_abort(i);
+            break;
+        }
+
+        // Length is in the second header byte
+        if (r->n_bytes == 1) {
+            uint8_t len = byte >> DM_HDR_LEN_SHIFT;
+            if (len > DM_FRAME_MAX_PAYLOAD) {
+                rx_stats[i].aborted++;
+                reset_channel(i);
+                break;
+            }
+            r->expected = DM_FRAME_BYTES(len);
+        }
+        if (r->n_bytes < r->expected - DM_CRC_LEN) r->crc = crc8_update(r->crc, byte);
+        r->bytes[r->n_bytes++] = byte;
+
+        if (r->n_bytes == r->expected) rx_frame_done(i);
+        break;
+    }
+}
+
+// Majority of samples in window, middle sample decides tie
+static uint8_t rx_clock_decide(dm_clock_t *clk) {
+    uint8_t level = (2 * clk->votes > clk->samples) || ((2 * clk->votes == clk->samples) && clk->center);
+    clk->phase = 0;
+    clk->samples = 0;
+    clk->votes = 0;
+    return level;
+}
 
-        if (!send_flag) {
-            current_level = 1;
+// Clock recovery, returns 1 if half-bit is done (stored in "level")
+static bool rx_clock_step(dm_clock_t *clk, uint8_t sample, bool locked, uint8_t *level) {
+    bool done = false;
 
-            // make the last bit 0 ----> for START_SIG = 0b1110
-            if (START_SIG == 0b1110){
-                if (tx_bit_index >= START_SIG_LEN-1) current_level = 0;
+    if (clk->n <= 1) {
+        *level = sample;
+        return true;
+    }
+
+    if (sample != clk->last) {
+        // Edge should be at the start of window
+        if (!locked) {
+            // Start new window right here, finish previous one if it's long enough
+            if (clk->samples >= clk->n / 2) {
+                *level = rx_clock_decide(clk);
+                done = true;
+            }
+            clk->phase = 0;
+            clk->samples = 0;
+            clk->votes = 0;
+        } else if (clk->phase > 0 && clk->phase < (clk->n + 1) / 2) {
+            clk->phase--;           // window is early, make it longer
+        } else if (clk->phase >= (clk->n + 1) / 2) {
+            // window is late, make it shorter (this sample already belongs to next one)
+            if (++clk->phase >= clk->n) {
+                *level = rx_clock_decide(clk);
+                done = true;
             }
+        }
+    }
+    clk->last = sample;
 
-        } else {
-            bit = (tx_buffer >> ((MSG_LENGTH - 1) - ((tx_bit_index / 2) % MSG_LENGTH))) & 1;
-            if (!(tx_bit_index & 1)) {
-                if (!bit) current_level = !current_level;
-            } else {
-                current_level = !current_level;
+    if (clk->phase == clk->n / 2) clk->center = sample;
+    clk->votes += sample;
+    clk->samples++;
+
+    if (++clk->phase < clk->n || done) return done;
+
+    *level = rx_clock_decide(clk);
+    return true;
+}
+
+// Read all channels, decided half-bits are passed to decoder
+static void rx_sample(void) {
+    uint8_t level;
+
+    adc_lib_read_all(adc1_results, adc2_results);
+    #if ADC_LIB_DMA
+    rx_carrier = rx_dma_carrier;
+    #else
+    rx_carrier = 0;
+    #endif
+
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        #if ADC_LIB_DMA
+        if ((i < adc1_size) && adc_lib_dma_running()) continue;    // Decoded in rx_dma_task()
+        #endif
+        int value = (i < adc1_size) ? adc1_results[i] : adc2_results[i - adc1_size];
+        #if DM_CARRIER
+        value = rx_demodulate(&rx_demod[i], value);
+        #endif
+        uint8_t sample = rx_slice(&rx_slicer[i], value);
+
+        rx_amp_add(&rx_dec[i], value, sample);
+        rx_carrier |= sample;
+        if (rx_clock_step(&rx_clock[i], sample, rx_dec[i].state != DM_RX_HUNT, &level)) rx_push(i, level);
+    }
+}
+
+#if ADC_LIB_DMA
+// ADC1 channels are sampled with DMA, DM_ADC_DMA_DECIMATE conversions are averaged into one sample
+static void rx_dma_task(void *arg) {
+    static adc_lib_sample_t samples[ADC_LIB_DMA_FRAME_BYTES / 2];
+    int sum[2] = {0};
+    int count[2] = {0};
+    uint8_t level;
+
+    while (1) {
+        int n = adc_lib_dma_read(samples, GET_SIZE(samples), DM_DMA_TIMEOUT_MS);
+        bool carrier = 0;
+
+        // DMA was given up, timer interrupt reads ADC1 again
+        if (!adc_lib_dma_running()) {
+            rx_dma_carrier = 0;
+            continue;
+        }
+
+        // Own LED can't be turned off for DMA conversions, CSMA backoff still listens
+        if (!reading || tx_on_air) {
+            rx_dma_carrier = 0;
+            for (int i = 0; i < adc1_size; i++) {
+                reset_channel(i);
+                sum[i] = count[i] = 0;
+                #if DM_CARRIER
+                rx_demod[i].fill = 0;
+                #endif
             }
+            continue;
         }
 
-        tx_bit_index++;
-        if (tx_bit_index >= (MSG_LENGTH * 2)) {
-            tx_bit_index = 0;
-            send_flag = 0;
-            current_level = 0;
-            sending = 0;
+        for (int k = 0; k < n; k++) {
+            for (int i = 0; i < adc1_size; i++) {
+                if (samples[k].channel != adc1_channels[i]) continue;
+
+                sum[i] += samples[k].value;
+                if (++count[i] < DM_ADC_DMA_DECIMATE) break;
+
+                int value = sum[i] / DM_ADC_DMA_DECIMATE;
+                #if DM_CARRIER
+                value = rx_demodulate(&rx_demod[i], value);
+                #endif
+                uint8_t sample = rx_slice(&rx_slicer[i], value);
+                rx_amp_add(&rx_dec[i], value, sample);
+                carrier |= sample;
+                sum[i] = count[i] = 0;
+                if (rx_clock_step(&rx_clock[i], sample, rx_dec[i].state != DM_RX_HUNT, &level)) rx_push(i, level);
+                break;
+            }
         }
-        multiple_led_drive(led_pins, led_size, current_level);
-        //#endif
+        rx_dma_carrier = carrier;
+    }
+}
+#endif
+
+// Rate field is separate from coded bytes, so rate can change for retransmission
+static void tx_set_rate(dm_tx_buf_t *buf, uint8_t rate) {
+    #if DM_FEC == DM_FEC_HAMMING
+    uint8_t field = (rate << 1) | buf->fec;
     #else
+    uint8_t field = rate;
+    #endif
+
+    buf->rate = rate;
+    buf->rate_levels = dm_encode_table[field << (8 - DM_RATE_LEN / 2)] >> (16 - DM_RATE_LEN);
+    buf->flip = buf->rate_levels & 1;
+    buf->ticks = (START_SIG_LEN + DM_RATE_LEN) * DM_OVERSAMPLE + (buf->half_bits - DM_RATE_LEN) * dm_rate_ticks[rate];
+}
+
+// Build frame for sending (header, CRC, FEC, half-bits)
+static void tx_load(dm_tx_buf_t *buf, const dm_frame_t *frame, uint8_t rate) {
+    uint8_t bytes[DM_MAX_FRAME_BYTES];
+    uint8_t coded[DM_MAX_CODED_BYTES];
+    uint8_t level = 0;
+
+    uint8_t src = frame->hops ? frame->src : ROBOT_ID;     // Relayed frame keeps its sender
+
+    bytes[0] = (src << DM_HDR_SRC_SHIFT) | (frame->dst & DM_HDR_DST_MASK);
+    bytes[1] = (frame->len << DM_HDR_LEN_SHIFT) | ((frame->type << DM_HDR_TYPE_SHIFT) & DM_HDR_TYPE_MASK) | (frame->ttl & DM_HDR_TTL_MASK);
+    bytes[2] = (frame->hops << DM_HDR_HOPS_SHIFT) | (frame->seq & DM_HDR_SEQ_MASK);
+    memcpy(&bytes[DM_HEADER_LEN], frame->payload, frame->len);
+    bytes[DM_HEADER_LEN + frame->len] = crc8(bytes, DM_HEADER_LEN + frame->len);
+
+    buf->fec = DM_FEC_USED(frame->len);
+    fec_encode(bytes, coded, DM_FRAME_BYTES(frame->len), buf->fec);
+    for (int j = 0; j < DM_CODED_BYTES(frame->len); j++) {
+        uint16_t pattern = dm_encode_table[coded[j]];
+        if (level) pattern = ~pattern;      // Table starts after LOW half-bit
+        buf->levels[j] = pattern;
+        level = pattern & 1;
+    }
+    buf->half_bits = DM_RATE_LEN + 16 * DM_CODED_BYTES(frame->len);
+    tx_set_rate(buf, rate);
+}
 
-        if(!reading) return;
-        
+// tx_data is finished, result belongs to dm_comm_send_frame() or relay
+static void tx_done(dm_tx_status_t status) {
+    sending = 0;
+    if (tx_relaying) {
+        tx_relaying = 0;
+        if (status == DM_TX_OK) relay_sent++;
+        else relay_dropped++;
+        return;
+    }
+    tx_status = status;
+}
+
+// Level of START_SIG half-bit
+static uint8_t tx_start_level(int index) {
+    uint8_t level = 1;
+
+    // make the last bit 0 ----> for START_SIG = 0b1110
+    if (START_SIG == 0b1110){
+        if (index >= START_SIG_LEN-1) level = 0;
+    }
+    return level;
+}
+
+// Level of half-bit after START_SIG (rate field and coded bytes)
+static uint8_t tx_data_level(const dm_tx_buf_t *buf, int index) {
+    if (index < DM_RATE_LEN) return (buf->rate_levels >> (DM_RATE_LEN - 1 - index)) & 1;
+
+    int j = index - DM_RATE_LEN;
+    return ((buf->levels[j / 16] >> (15 - j % 16)) & 1) ^ buf->flip;
+}
+
+// Frame was sent (from timer interrupt or RMT interrupt)
+static void tx_end(void) {
+    tx_frames++;
+    tx_bit_index = 0;
+    send_flag = 0;
+    tx_level = 0;
+    tx_on_air = 0;
+
+    // Frame from dm_comm_send_frame() could be waiting behind beacon or ACK
+    if (tx_cur != &tx_data) {
+        tx_cur = &tx_data;
+    } else if (tx_ack_req) {
+        tx_wait_ack = 1;
+        ack_timer = DM_ACK_TIMEOUT_TICKS;
+    } else {
+        tx_done(DM_TX_OK);
+    }
+
+    csma_cw = DM_CSMA_CW_MIN;
+    csma_idle_ticks = 0;        // Gap before next frame
+}
+
+// LEDs for this tick of half-bit, HIGH is sent as carrier
+static void tx_led_drive(uint8_t level) {
+    #if DM_CARRIER
+    level = level && (carrier_tick % DM_CARRIER_TICKS >= DM_CARRIER_TICKS / 2);
+    #endif
+    multiple_led_drive(led_pins, led_size, level);
+}
+
+// Drive LEDs for next half-bit of frame
+static void tx_step(void) {
+    if ((tx_bit_index >= START_SIG_LEN) && !send_flag) {
+        send_flag = 1;
+        tx_level = 0;
+        tx_bit_index = 0;
+    }
+
+    // Rate field is sent with base rate
+    tx_ticks = (send_flag && tx_bit_index >= DM_RATE_LEN) ? dm_rate_ticks[tx_cur->rate] : DM_OVERSAMPLE;
+
+    if (send_flag && (tx_bit_index >= tx_cur->half_bits)) {
+        tx_end();
         multiple_led_drive(led_pins, led_size, 0);
-        
-        if(reading){    
-            adc_lib_read_all_logical(adc1_results, adc2_results, rx_buffer, SIG_THRESHOLD);
-            for (int i = 0; i < CHANNEL_NUM; i++) rx_count[i]++;
+        return;
+    }
+
+    if (!send_flag) tx_level = tx_start_level(tx_bit_index);
+    else tx_level = tx_data_level(tx_cur, tx_bit_index);
+
+    tx_bit_index++;
+    tx_led_drive(tx_level);
+}
+
+#if DM_TX_RMT
+// Whole frame as RMT symbols, half-bits with the same level are joined
+static int rmt_encode_frame(const dm_tx_buf_t *buf, rmt_symbol_word_t *symbols) {
+    int runs = 0;
+    uint8_t run_level = tx_start_level(0);
+    uint32_t run_us = 0;
+    uint8_t level = 0;
+
+    int total = START_SIG_LEN + buf->half_bits;
+    for (int k = 0; k <= total; k++) {
+        uint32_t us = DM_OVERSAMPLE * DM_TICK_US;
+        if (k < START_SIG_LEN) {
+            level = tx_start_level(k);
+        } else if (k < total) {
+            int index = k - START_SIG_LEN;
+            level = tx_data_level(buf, index);
+            if (index >= DM_RATE_LEN) us = dm_rate_ticks[buf->rate] * DM_TICK_US;
+        } else {
+            level = !run_level;     // Close the last run
         }
 
+        if (level == run_level) {
+            run_us += us;
+            continue;
+        }
+        if (runs & 1) {
+            symbols[runs / 2].level1 = run_level;
+            symbols[runs / 2].duration1 = run_us;
+        } else {
+            symbols[runs / 2].level0 = run_level;
+            symbols[runs / 2].duration0 = run_us;
+        }
+        runs++;
+        run_level = level;
+        run_us = us;
+    }
 
-        //  This part is buggy
-
-        // // If backoff is active, skip checking and transmitting
-        // if (backoff_active) {
-        //     if(backoff_countdown-- == 0) backoff_active = 0;  // Counting down, when reaching 0, check again
-        //     return;
-        // }
-        
-        // channel_occupied = 0;
-        // for (int i = 0; i < adc1_size; i++) {
-        //     if (adc1_results[i] > SIG_THRESHOLD) {
-        //         channel_occupied = 1;
-        //         break;
-        //     }
-        // }
-        // for (int i = 0; i < adc2_size; i++) {
-        //     if (adc2_results[i] > SIG_THRESHOLD) {
-        //         channel_occupied = 1;
-        //         break;
-        //     }
-        // }
-
-        // // If channel is busy, start backoff timer
-        // if (channel_occupied) {
-        //     multiple_led_drive(led_pins, led_size, 0);
-        //     backoff_active = 1;
-        //     sending = 0;
-        //     backoff_countdown = (rand() % (MAX_BACKOFF_CYCLE * CYCLE_BIT_COUNT)) + (MIN_BACKOFF_CYCLE * CYCLE_BIT_COUNT); // Random backoff
-        //     return;  // Skip transmission
-        // }
-
-        
-
-        if (!sending) return;
-
-        if (sending && channel_occupied) {
-            multiple_led_drive(led_pins, led_size, 0);
-            sending = 0;        // Abort sending if the channel gets occupied
-            backoff_active = 1;
-            return;
-        } 
+    // LED stays LOW after the last run (eot_level)
+    if (runs & 1) {
+        symbols[runs / 2].level1 = 0;
+        symbols[runs / 2].duration1 = DM_TICK_US;
+        runs++;
+    }
+    return runs / 2;
+}
 
-        static uint8_t current_level = 0;
-        static uint8_t send_flag = 0;
-        uint8_t bit;
+// Frames are handed to RMT in a task, rmt_transmit() can't be called from interrupt
+static void rmt_tx_task(void *arg) {
+    static rmt_symbol_word_t symbols[DM_RMT_MAX_SYMBOLS];
+    rmt_transmit_config_t config = {
+        .loop_count = 0,
+        .flags.eot_level = 0,
+    };
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-        if ((tx_bit_index >= START_SIG_LEN) && !send_flag) {
-            send_flag = 1;
-            current_level = 0;
-            tx_bit_index = 0;
+        // tx_cur doesn't change until rmt_tx_done()
+        int n = rmt_encode_frame(tx_cur, symbols);
+        rmt_led_level = 0;
+        if (rmt_sync) rmt_sync_reset(rmt_sync);
+        for (int k = 0; k < rmt_count; k++) {
+            rmt_transmit(rmt_channels[k], rmt_encoders[k], symbols, n * sizeof(rmt_symbol_word_t), &config);
         }
+    }
+}
+
+static bool rmt_tx_done(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *ctx) {
+    portENTER_CRITICAL_ISR(&tx_lock);
+    if (tx_on_air) tx_end();    // Not after dm_comm_led_drive()
+    portEXIT_CRITICAL_ISR(&tx_lock);
+    return false;
+}
 
-        if (!send_flag) {
-            current_level = 1;
+static esp_err_t rmt_tx_init(void) {
+    rmt_tx_channel_config_t channel_config = {
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = 1000000,       // Durations in us
+        .mem_block_symbols = DM_RMT_MEM_SYMBOLS,
+        .trans_queue_depth = 2,
+    };
+    rmt_copy_encoder_config_t encoder_config = {};
+    rmt_tx_event_callbacks_t callbacks = {
+        .on_trans_done = rmt_tx_done,
+    };
+    #if DM_CARRIER
+    // Carrier only while frame is sent, level left by dm_comm_led_drive() stays steady
+    rmt_carrier_config_t carrier_config = {
+        .frequency_hz = DM_CARRIER_HZ,
+        .duty_cycle = 0.5,
+    };
+    #endif
+    esp_err_t err;
+
+    rmt_count = (led_size < DM_RMT_MAX_LEDS) ? led_size : DM_RMT_MAX_LEDS;
+    for (int k = 0; k < rmt_count; k++) {
+        channel_config.gpio_num = led_pins[k];
+        err = rmt_new_tx_channel(&channel_config, &rmt_channels[k]);
+        if (err != ESP_OK) return err;
+        err = rmt_new_copy_encoder(&encoder_config, &rmt_encoders[k]);
+        if (err != ESP_OK) return err;
+        // Channels end together, one callback is enough
+        if (k == 0) rmt_tx_register_event_callbacks(rmt_channels[k], &callbacks, NULL);
+        #if DM_CARRIER
+        err = rmt_apply_carrier(rmt_channels[k], &carrier_config);
+        if (err != ESP_OK) return err;
+        #endif
+        err = rmt_enable(rmt_channels[k]);
+        if (err != ESP_OK) return err;
+    }
+
+    // LEDs start at the same time
+    if (rmt_count > 1) {
+        rmt_sync_manager_config_t sync_config = {
+            .tx_channel_array = rmt_channels,
+            .array_size = rmt_count,
+        };
+        err = rmt_new_sync_manager(&sync_config, &rmt_sync);
+        if (err != ESP_OK) return err;
+    }
+
+    if (xTaskCreatePinnedToCore(rmt_tx_task, "dm_rmt_tx", DM_RMT_TASK_STACK, NULL, DM_RMT_TASK_PRIORITY, &rmt_task, DM_CORE) != pdPASS) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+#endif
+
+
+static void tx_start(void) {
+    tx_on_air = 1;
+    tx_deferred = 0;
+    csma_wait_ticks = 0;
+    tx_low_ticks = 0;
+    tx_collision_samples = 0;
+    tx_tick = DM_OVERSAMPLE - 1;    // first half-bit on this tick
+
+    // Called from timer interrupt only
+    #if DM_TX_RMT
+    vTaskNotifyGiveFromISR(rmt_task, NULL);
+    #endif
+}
+
+// Channel is busy if anything is received (signal or frame in progress)
+static bool csma_channel_busy(void) {
+    if (rx_carrier) return true;
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        if (rx_dec[i].state != DM_RX_HUNT) return true;
+    }
+    return false;
+}
+
+// Waiting frame starts after channel was idle for DM_CSMA_IDLE_TICKS and backoff slots passed
+static void csma_step(void) {
+    // Channel won't get free (stuck sender or strong ambient light)
+    if (++csma_wait_ticks >= DM_CSMA_MAX_WAIT_TICKS) {
+        csma_dropped++;
+        csma_cw = DM_CSMA_CW_MIN;
+        tx_deferred = 0;
+        csma_backoff = 0;
+        tx_done(DM_TX_FAILED);
+        return;
+    }
+
+    if (csma_channel_busy()) {
+        csma_idle_ticks = 0;
+        if (!tx_deferred) {
+            tx_deferred = 1;
+            csma_deferrals++;
+            if (!csma_backoff) csma_backoff = esp_random() % csma_cw;
+        }
+        return;
+    }
+
+    // Backoff is frozen while channel is busy
+    if (csma_idle_ticks < DM_CSMA_IDLE_TICKS) {
+        csma_idle_ticks++;
+        return;
+    }
+    if (csma_backoff) {
+        if (++csma_slot_tick >= DM_CSMA_SLOT_TICKS) {
+            csma_slot_tick = 0;
+            csma_backoff--;
+        }
+        return;
+    }
+
+    tx_start();
+}
+
+#if DM_TDMA
+// Superframe timing, master starts beacon at the beginning
+static void tdma_clock(void) {
+    if (++tdma_tick >= DM_TDMA_SUPERFRAME_TICKS) {
+        tdma_tick = 0;
+        if (tdma_missed < DM_TDMA_SYNC_LOST) tdma_missed++;
+
+        if (tdma_master) {
+            tdma_missed = 0;
+            tdma_beacon_due = reading;
+        }
+    }
 
-            // make the last bit 0 ----> for START_SIG = 0b1110
-            if (START_SIG == 0b1110){
-                if (tx_bit_index >= START_SIG_LEN-1) current_level = 0;
+    if (!reading) tdma_beacon_due = 0;
+    if (!tdma_beacon_due) return;
+
+    // ACK waiting for SIFS goes first, superframe starts with the beacon after it
+    portENTER_CRITICAL_ISR(&tx_lock);
+    if (!tx_on_air && (tx_cur != &tx_ack)) {
+        tdma_beacon_due = 0;
+        tdma_tick = 0;
+        tx_cur = &tx_beacon;
+        tx_start();
+    }
+    portEXIT_CRITICAL_ISR(&tx_lock);
+}
+
+static bool tdma_synced(void) {
+    return tdma_missed < DM_TDMA_SYNC_LOST;
+}
+
+// Waiting frame is sent in own slot, only if it ends before the slot does
+static void tdma_step(void) {
+    uint16_t start = DM_TDMA_BEACON_TICKS + DM_TDMA_OWN_SLOT * DM_TDMA_SLOT_TICKS;
+    uint16_t ticks = tx_data.ticks + (tx_ack_req ? DM_ACK_TIMEOUT_TICKS : 0);
+
+    csma_wait_ticks = 0;
+    if (tdma_tick < start) return;
+    if (tdma_tick + ticks + DM_TDMA_GUARD_TICKS > start + DM_TDMA_SLOT_TICKS) return;
+    tx_start();
+}
+
+// Beacon ended, superframe started DM_TDMA_FRAME_TICKS(0) ago
+static void tdma_beacon(void) {
+    if (tdma_master) return;
+    tdma_tick = DM_TDMA_FRAME_TICKS(0);
+    tdma_missed = 0;
+}
+#endif
+
+// Someone else is sending if signal is received while own LED was LOW for a whole tick
+static bool csma_collision(void) {
+    if (tx_level) {
+        tx_low_ticks = 0;
+        return false;
+    }
+    // Demodulated signal lags by up to one carrier period
+    if (++tx_low_ticks < (DM_CARRIER ? DM_CARRIER_TICKS : 2)) return false;
+    if (rx_carrier) tx_collision_samples++;
+    return tx_collision_samples >= DM_CSMA_COLLISION_SAMPLES;
+}
+
+// Frame is sent again after longer backoff or dropped
+static void csma_abort(void) {
+    multiple_led_drive(led_pins, led_size, 0);
+    csma_collisions++;
+    tx_on_air = 0;
+    tx_level = 0;
+    tx_bit_index = 0;
+    send_flag = 0;
+    csma_idle_ticks = 0;
+    csma_slot_tick = 0;
+
+    // Beacon or ACK is not repeated
+    if (tx_cur != &tx_data) {
+        tx_cur = &tx_data;
+        return;
+    }
+
+    if (++csma_attempts > DM_CSMA_MAX_RETRIES) {
+        csma_dropped++;
+        csma_cw = DM_CSMA_CW_MIN;
+        tx_done(DM_TX_FAILED);
+        return;
+    }
+
+    if (csma_cw < DM_CSMA_CW_MAX) csma_cw *= 2;
+    csma_backoff = esp_random() % csma_cw;
+}
+
+// No ACK in time, frame is sent again with CSMA/CA (or in next TDMA slot)
+static void ack_wait_step(void) {
+    if (--ack_timer) return;
+
+    tx_wait_ack = 0;
+    dm_comm_rate_report(tx_dst, false);
+
+    if (++ack_retries > DM_ACK_MAX_RETRIES) {
+        ack_failed++;
+        tx_done(DM_TX_FAILED);
+        return;
+    }
+
+    ack_retransmits++;
+    tx_set_rate(&tx_data, dm_comm_get_rate(tx_dst));
+    csma_attempts = 0;
+    csma_wait_ticks = 0;
+    csma_backoff = esp_random() % csma_cw;
+}
+
+// Received frame asks for ACK, it's sent after DM_ACK_SIFS_TICKS without carrier sense
+static void tx_send_ack(uint8_t dst, uint8_t seq) {
+    dm_frame_t ack = {
+        .dst = dst,
+        .type = DM_TYPE_ACK,
+        .seq = seq,         // ACK belongs to this frame
+        .len = 0,
+    };
+
+    portENTER_CRITICAL_SAFE(&tx_lock);
+    // Can't answer while sending, the other robot will try again
+    if (!tx_on_air && (tx_cur == &tx_data)) {
+        tx_load(&tx_ack, &ack, 0);
+        tx_cur = &tx_ack;
+        ack_sifs = DM_ACK_SIFS_TICKS;
+    }
+    portEXIT_CRITICAL_SAFE(&tx_lock);
+}
+
+static void tx_ack_received(uint8_t src, uint8_t seq) {
+    bool done = false;
+
+    portENTER_CRITICAL_SAFE(&tx_lock);
+    // Late ACK of previous frame doesn't count
+    if (tx_wait_ack && (src == tx_dst) && (seq == tx_seq)) {
+        tx_wait_ack = 0;
+        tx_done(DM_TX_OK);
+        done = true;
+    }
+    portEXIT_CRITICAL_SAFE(&tx_lock);
+
+    if (done) dm_comm_rate_report(src, true);
+}
+
+// Remember frame in table, return "1" if it was seen already
+static bool seen_check(dm_seen_t *table, const dm_frame_t *frame) {
+    if (frame->src == 0 || frame->src >= DM_MAX_ROBOTS) return false;
+
+    dm_seen_t *s = &table[frame->src];
+    int64_t now = esp_timer_get_time();
+
+    if (now - s->last_heard > DM_DEDUP_TIMEOUT_US) {
+        s->count = 0;
+        s->next = 0;
+    }
+    s->last_heard = now;
+
+    for (int k = 0; k < s->count; k++) {
+        if (s->seq[k] == frame->seq) return true;
+    }
+
+    s->seq[s->next] = frame->seq;
+    s->next = (s->next + 1) % DM_DEDUP_DEPTH;
+    if (s->count < DM_DEDUP_DEPTH) s->count++;
+    return false;
+}
+
+// Received broadcast frame with TTL left is sent again after random delay, only once.
+// Waiting relay is dropped when another robot's relay of the frame is heard first
+static void relay_push(const dm_frame_t *frame) {
+    portENTER_CRITICAL_SAFE(&tx_lock);
+    if (seen_check(relay_seen, frame)) {
+        relay_suppressed++;
+        for (int k = 0; frame->hops && (k < relay_len); k++) {
+            if ((relay_queue[k].frame.src == frame->src) && (relay_queue[k].frame.seq == frame->seq)) {
+                relay_len--;
+                memmove(&relay_queue[k], &relay_queue[k + 1], (relay_len - k) * sizeof(dm_relay_t));
+                break;
             }
+        }
+    } else if ((relay_len >= DM_RELAY_QUEUE_LEN) || reading_stop_due) {
+        relay_dropped++;
+    } else {
+        dm_relay_t *e = &relay_queue[relay_len++];
+        e->frame = *frame;
+        e->frame.ttl--;
+        e->frame.hops++;
+        // Robots which heard the same frame don't send at once
+        e->delay = DM_RELAY_DELAY_TICKS + esp_random() % DM_RELAY_JITTER_TICKS;
+    }
+    portEXIT_CRITICAL_SAFE(&tx_lock);
+}
+
+// Relayed frame is sent like one from dm_comm_send_frame(), when nothing else is sent
+static void relay_step(void) {
+    int k;
 
+    for (k = 0; k < relay_len; k++) {
+        if (relay_queue[k].delay) relay_queue[k].delay--;
+    }
+    if (sending || tx_on_air || (tx_cur != &tx_data)) return;
+
+    for (k = 0; k < relay_len; k++) {
+        if (!relay_queue[k].delay) break;
+    }
+    if (k == relay_len) return;
+
+    dm_frame_t frame = relay_queue[k].frame;
+    relay_len--;
+    memmove(&relay_queue[k], &relay_queue[k + 1], (relay_len - k) * sizeof(dm_relay_t));
+
+    #if DM_TDMA
+    // Frame has to fit in TDMA slot
+    if (tdma_synced() && (DM_TDMA_FRAME_TICKS(frame.len) + DM_TDMA_GUARD_TICKS > DM_TDMA_SLOT_TICKS)) {
+        relay_dropped++;
+        return;
+    }
+    #endif
+
+    tx_load(&tx_data, &frame, dm_comm_get_rate(DM_ADDR_BROADCAST));
+
+    tx_dst = DM_ADDR_BROADCAST;
+    tx_ack_req = 0;
+    tx_wait_ack = 0;
+    csma_attempts = 0;
+    csma_wait_ticks = 0;
+    tx_relaying = 1;
+    sending = 1;
+}
+
+// Relays are dropped when reading starts again, they would go out long after the frame (as new one)
+static void relay_clear(void) {
+    portENTER_CRITICAL(&tx_lock);
+    relay_dropped += relay_len;
+    relay_len = 0;
+    if (tx_relaying && !tx_on_air) tx_done(DM_TX_FAILED);
+    portEXIT_CRITICAL(&tx_lock);
+}
+
+// Nothing waits to be sent, relays and ACK included
+static bool tx_idle(void) {
+    return !sending && !relay_len && (tx_cur == &tx_data);
+}
+
+static void reading_off(void) {
+    reading = 0;
+    reading_stop_due = 0;
+    read_flag = 0;
+    for (int i = 0; i < CHANNEL_NUM; i++) reset_channel(i);
+}
+
+// Sending part of timer interrupt
+static void tx_tick_step(void) {
+    relay_step();
+
+    if (!tx_on_air) {
+        if (tx_cur == &tx_ack) {
+            if (--ack_sifs) return;
+            tx_start();
+        } else if (!sending) {
+            return;
+        } else if (tx_wait_ack) {
+            ack_wait_step();
+            return;
         } else {
-            bit = (tx_buffer >> ((MSG_LENGTH - 1) - ((tx_bit_index / 2) % MSG_LENGTH))) & 1;
-            if (!(tx_bit_index & 1)) {
-                if (!bit) current_level = !current_level;
-            } else {
-                current_level = !current_level;
-            }
+            #if DM_TDMA
+            if (tdma_synced()) tdma_step();
+            else csma_step();
+            #else
+            csma_step();
+            #endif
+            if (!tx_on_air) return;
         }
+    } else if (!DM_TX_RMT && csma_collision()) {
+        csma_abort();
+        return;
+    }
+
+    #if DM_TX_RMT
+    return;     // RMT sends the frame, rmt_tx_done() ends it
+    #endif
 
-        tx_bit_index++;
-        if (tx_bit_index >= (MSG_LENGTH * 2)) {
-            tx_bit_index = 0;
-            send_flag = 0;
-            current_level = 0;
-            sending = 0;
+    // LEDs are turned off for reading, keep level until next half-bit
+    if (++tx_tick < tx_ticks) {
+        tx_led_drive(tx_level);
+        return;
+    }
+    tx_tick = 0;
+    tx_step();
+}
+
+static void timer1_callback() {
+
+    #if DM_CARRIER
+    carrier_tick++;
+    #endif
+
+    #if DM_TDMA
+    tdma_clock();
+    #endif
+
+    if(!reading) return;
+
+    #if DM_TX_RMT
+    // LEDs are driven by RMT, own frame would be received
+    if (tx_on_air) {
+        for (int i = 0; i < CHANNEL_NUM; i++) {
+            reset_channel(i);
+            #if DM_CARRIER
+            rx_demod[i].fill = 0;
+            #endif
         }
-        multiple_led_drive(led_pins, led_size, current_level);
+        rx_carrier = 0;
+    } else {
+        rx_sample();
+    }
+    #else
+    multiple_led_drive(led_pins, led_size, 0);
+
+    rx_sample();
     #endif
+
+    // Backoff set by dm_comm_set_backoff()
+    if (backoff_active && (--backoff_countdown <= 0)) backoff_active = 0;
+
+    portENTER_CRITICAL_ISR(&tx_lock);
+    tx_tick_step();
+    // Stop delayed by dm_comm_reading_stop()
+    if (reading_stop_due && tx_idle()) reading_off();
+    portEXIT_CRITICAL_ISR(&tx_lock);
+}
+
+
+// Signals are read on DM_CORE when sense_wait() asks, readers copy the other buffer
+// than the one being written. ADC isn't read beside the timer interrupt without need
+static void sense_task(void *arg) {
+    int adc1[2], adc2[4];
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        adc_lib_read_all(adc1, adc2);
+
+        uint32_t seq = __atomic_load_n(&sense_seq, __ATOMIC_RELAXED);
+        int *next = sense_buf[(seq + 1) & 1];
+        for (int i = 0; i < adc1_size; i++) next[i] = adc1[i];
+        for (int i = 0; i < adc2_size; i++) next[i + adc1_size] = adc2[i];
+        __atomic_store_n(&sense_seq, seq + 1, __ATOMIC_RELEASE);
+
+        TaskHandle_t waiter = __atomic_load_n(&sense_waiter, __ATOMIC_ACQUIRE);
+        if (waiter) xTaskNotifyGive(waiter);
+    }
 }
 
+// Copy of next snapshot (read after the call)
+static void sense_wait(int signals[CHANNEL_NUM]) {
+    uint32_t start = __atomic_load_n(&sense_seq, __ATOMIC_ACQUIRE);
+    uint32_t seq;
+
+    __atomic_store_n(&sense_waiter, xTaskGetCurrentTaskHandle(), __ATOMIC_RELEASE);
+    xTaskNotifyGive(sense_handle);
+    // Notification left from a frame (dm_comm_wait_frame) only causes one more check
+    while (__atomic_load_n(&sense_seq, __ATOMIC_ACQUIRE) == start) ulTaskNotifyTake(pdTRUE, 1);
+    __atomic_store_n(&sense_waiter, NULL, __ATOMIC_RELEASE);
+
+    // Writer only touches the other buffer until it publishes again
+    do {
+        seq = __atomic_load_n(&sense_seq, __ATOMIC_ACQUIRE);
+        memcpy(signals, sense_buf[seq & 1], sizeof(sense_buf[0]));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);   // Copy is done before checking
+    } while (__atomic_load_n(&sense_seq, __ATOMIC_RELAXED) != seq);
+}
+
+#if DM_STATS_DUMP_MS
+// Periodic log, on DM_LOG_CORE away from interrupts
+static void stats_dump_task(void *arg) {
+    TickType_t wake = xTaskGetTickCount();
+
+    while (1) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(DM_STATS_DUMP_MS));
+        dm_comm_stats_dump();
+    }
+}
+#endif
 
 void dm_comm_init(adc1_channel_t *adc1_ch, int a1_size, adc2_channel_t *adc2_ch, int a2_size, gpio_num_t *leds, int l_size) {
     adc1_channels = adc1_ch;
@@ -210,124 +1332,369 @@ void dm_comm_init(adc1_channel_t *adc1_ch, int a1_size, adc2_channel_t *adc2_ch,
         .atten = ADC_ATTEN_DB_0
     };
     adc_lib_init_all(&adc1_config, &adc2_config);
+    #if DM_TX_RMT
+    if (rmt_tx_init() != ESP_OK) ESP_LOGE("dm_comm", "RMT init failed");
+    #else
     multiple_led_init(led_pins, led_size);
-    hwtimer_init(timer_comm, 1000000, BIT_DURATION_US, timer1_callback);
+    #endif
+    #if DM_FEC == DM_FEC_HAMMING
+    hamming_init();
+    #endif
+    dm_table_init();
+    for (int i = 0; i < CHANNEL_NUM; i++) rx_clock[i].n = DM_OVERSAMPLE;
+
+    #if ADC_LIB_DMA
+    if (adc_lib_dma_init(&adc1_config, DM_ADC_DMA_DECIMATE * 1000000 / DM_TICK_US) == ESP_OK) {
+        xTaskCreatePinnedToCore(rx_dma_task, "dm_rx_dma", DM_DMA_TASK_STACK, NULL, DM_DMA_TASK_PRIORITY, NULL, DM_CORE);
+    } else {
+        ESP_LOGE("dm_comm", "ADC DMA init failed");
+    }
+    #endif
 
+    xTaskCreatePinnedToCore(sense_task, "dm_sense", DM_SENSE_TASK_STACK, NULL, DM_SENSE_TASK_PRIORITY, &sense_handle, DM_CORE);
+
+    #if DM_STATS_DUMP_MS
+    xTaskCreatePinnedToCore(stats_dump_task, "dm_stats", DM_LOG_TASK_STACK, NULL, DM_LOG_TASK_PRIORITY, NULL, DM_LOG_CORE);
+    #endif
+
+    // Restarted robot doesn't reuse sequence numbers others remember
+    tx_seq = esp_random() & DM_HDR_SEQ_MASK;
+
+    #if DM_OWN_TIMER
+    hwtimer_init(timer_comm, 1000000, DM_TICK_US, timer1_callback);
+    #else
+    hwtimer_job_init(&timer_comm, timer1_callback);
+    hwtimer_job_start(&timer_comm, DM_TICK_US, DM_TICK_US);
+    #endif
+
+}
+
+void dm_comm_led_drive(bool on) {
+    #if DM_TX_RMT
+    // RMT owns the pins, LEDs keep the level after one short symbol
+    if (on == rmt_led_level) return;
+    rmt_led_level = on;
+    rmt_symbol_word_t symbol = {.level0 = on, .duration0 = 1, .level1 = on, .duration1 = 1};
+    rmt_transmit_config_t config = {
+        .loop_count = 0,
+        .flags.eot_level = on,
+    };
+    for (int k = 0; k < rmt_count; k++) {
+        rmt_transmit(rmt_channels[k], rmt_encoders[k], &symbol, sizeof(symbol), &config);
+    }
+    #else
+    multiple_led_drive(led_pins, led_size, on);
+    #endif
 }
 
 void dm_comm_start() {
+    #if DM_OWN_TIMER
     hwtimer_start(timer_comm);
+    #else
+    hwtimer_job_start(&timer_comm, DM_TICK_US, DM_TICK_US);
+    #endif
 }
 
 void dm_comm_stop() {
+    #if DM_OWN_TIMER
     hwtimer_stop(timer_comm);
+    #else
+    hwtimer_job_stop(&timer_comm);
+    #endif
+}
+
+bool dm_comm_send(int message) {
+    dm_frame_t frame = {
+        .dst = DM_ADDR_BROADCAST,
+        .len = 1,
+        .payload = {message}
+    };
+    return dm_comm_send_frame(&frame);
 }
 
-void dm_comm_send(int message) {
-    if (channel_occupied || backoff_active) return;
+bool dm_comm_send_cmd(int message) {
+    dm_frame_t frame = {
+        .dst = DM_ADDR_BROADCAST,
+        .ttl = DM_CMD_TTL,
+        .len = 1,
+        .payload = {message}
+    };
+    return dm_comm_send_frame(&frame);
+}
 
-    tx_buffer = message;
-    sending = 1;
+bool dm_comm_send_frame(const dm_frame_t *frame) {
+    bool ack_req = (frame->type == DM_TYPE_DATA) && (frame->dst != DM_ADDR_BROADCAST);
+    bool accepted = false;
+
+    if (frame->len > DM_FRAME_MAX_PAYLOAD) return false;
+
+    #if DM_TDMA
+    // Frame has to fit in TDMA slot (at base rate, link rate can drop before it's sent)
+    uint16_t ticks = DM_TDMA_FRAME_TICKS(frame->len) + (ack_req ? DM_ACK_TIMEOUT_TICKS : 0);
+    if (tdma_synced() && (ticks + DM_TDMA_GUARD_TICKS > DM_TDMA_SLOT_TICKS)) return false;
+    #endif
+
+    portENTER_CRITICAL(&tx_lock);
+    if (!backoff_active && !sending) {
+        dm_frame_t numbered = *frame;
+        numbered.seq = (tx_seq + 1) & DM_HDR_SEQ_MASK;
+        numbered.hops = 0;
+        tx_load(&tx_data, &numbered, dm_comm_get_rate(frame->dst));
+        tx_dst = frame->dst;
+        tx_ack_req = ack_req;
+        accepted = true;
+    }
+    if (accepted) {
+        tx_seq = (tx_seq + 1) & DM_HDR_SEQ_MASK;
+        tx_wait_ack = 0;
+        ack_retries = 0;
+        csma_attempts = 0;
+        csma_wait_ticks = 0;
+        tx_status = DM_TX_PENDING;
+        sending = 1;                // started by csma_step()
+    }
+    portEXIT_CRITICAL(&tx_lock);
+
+    return accepted;
 }
 
-void dm_comm_reading_stop(void){
-    reading = 0;
-    // rx_count = 0;
-    read_flag = 0;
-    for (int i = 0; i < CHANNEL_NUM; i++)
-    {
-        rx_buffer[i] = 0;
+dm_tx_status_t dm_comm_tx_status(void) {
+    return tx_status;
+}
+
+// Channels take turns, so one busy channel can't block the others
+static bool rx_pop_next(dm_frame_t *frame) {
+    for (int k = 0; k < CHANNEL_NUM; k++) {
+        int i = (rx_next_channel + k) % CHANNEL_NUM;
+        if (rx_queue_pop(&rx_queue[i], frame)) {
+            rx_next_channel = (i + 1) % CHANNEL_NUM;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool dm_comm_recv_frame(dm_frame_t *frame) {
+    while (rx_pop_next(frame)) {
+        if (!seen_check(rx_seen, frame)) return true;
+        rx_duplicates++;
     }
+    return false;
+}
+
+void dm_comm_reading_stop(void){
+    // Queued relays still go out, robots out of sight of the sender need them
+    portENTER_CRITICAL(&tx_lock);
+    if (tx_idle()) reading_off();
+    else reading_stop_due = 1;
+    portEXIT_CRITICAL(&tx_lock);
 }
 
 void dm_comm_reading_start(void){
+    dm_frame_t frame;
+
+    // Frames from before reading was stopped are old
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        while (rx_queue_pop(&rx_queue[i], &frame));
+    }
+    portENTER_CRITICAL(&tx_lock);
+    reading_stop_due = 0;
+    portEXIT_CRITICAL(&tx_lock);
+    relay_clear();
     reading = 1;
 }
 
 bool dm_comm_detect_start_sig() {
-    bool any_start = false;
+    bool any_start = start_flag;
 
-    for (int i = 0; i < CHANNEL_NUM; i++) {
-        if (!start_detected[i] && rx_buffer[i] == START_SIG) {
-            start_detected[i] = 1;
-            rx_count[i] = 0;
-            rx_buffer[i] = 0;
-            any_start = true;
-        } else if (!start_detected[i] &&
-                   ((i < adc1_size && adc1_results[i] <= SIG_THRESHOLD) ||
-                    (i >= adc1_size && adc2_results[i - adc1_size] <= SIG_THRESHOLD))) {
-            rx_buffer[i] = 0;
-        }
+    start_flag = 0;
+    return any_start;
+}
+
+
+// Called from timer interrupt (or DMA task for ADC1 channels) only
+static bool rx_queue_push(dm_rx_queue_t *q, const dm_frame_t *frame) {
+    uint8_t head = q->head;
+    uint8_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    if ((uint8_t)(head - tail) >= DM_RX_QUEUE_LEN) {
+        q->dropped++;
+        return false;
     }
+    q->frames[head % DM_RX_QUEUE_LEN] = *frame;
+    __atomic_store_n(&q->head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+
+    // hwtimer always yields on interrupt exit, so woken task runs right away
+    TaskHandle_t waiter = rx_waiter;
+    if (waiter) {
+        if (xPortInIsrContext()) vTaskNotifyGiveFromISR(waiter, NULL);
+        else xTaskNotifyGive(waiter);
+    }
+    return true;
+}
 
-    return any_start;
+// Called from reading task only
+static bool rx_queue_pop(dm_rx_queue_t *q, dm_frame_t *frame) {
+    uint8_t tail = q->tail;
+    uint8_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail) return false;
+    *frame = q->frames[tail % DM_RX_QUEUE_LEN];
+    __atomic_store_n(&q->tail, (uint8_t)(tail + 1), __ATOMIC_RELEASE);
+    return true;
+}
+
+static dm_link_t *get_link(uint8_t id) {
+    if (id == 0 || id >= DM_MAX_ROBOTS) return NULL;
+    return &links[id];
 }
 
+// Copies of one frame on other channels end within few half-bits, older values are cleared
+static void rx_strength_save(dm_link_t *link, int i, uint8_t seq, uint16_t peak, uint16_t mean) {
+    int64_t now = esp_timer_get_time();
 
-void decode_channel(int i) {
-    if (rx_count[i] != 2 * MSG_LENGTH) return;
+    // Channels are decoded in timer interrupt and DMA task
+    portENTER_CRITICAL_SAFE(&link_lock);
+    if ((seq != link->strength_seq) || (now - link->strength_time > DM_STRENGTH_MERGE_US)) {
+        memset(link->peak, 0, sizeof(link->peak));
+        memset(link->mean, 0, sizeof(link->mean));
+        link->strength_seq = seq;
+    }
+    link->strength_time = now;
+    link->peak[i] = peak;
+    link->mean[i] = mean;
+    portEXIT_CRITICAL_SAFE(&link_lock);
+}
 
-    uint8_t rx_bit, rx_bit_prev;
-    msg[i] = 0;
+// Called from timer interrupt when all frame bytes are decoded
+static void rx_frame_done(int i) {
+    dm_rx_t *r = &rx_dec[i];
+    uint8_t len = r->expected - DM_HEADER_LEN - DM_CRC_LEN;
+    dm_frame_t frame;
 
-    for (int j = 0; j < 2 * MSG_LENGTH; j += 2) {
-        rx_bit = (rx_buffer[i] >> ((2 * MSG_LENGTH - 1) - j)) & 1;
+    if (r->crc != r->bytes[DM_HEADER_LEN + len]) {
+        rx_stats[i].crc_errors++;
+        rx_abort(i);
+        return;
+    }
+    rx_stats[i].frames++;
+    frame.peak = r->peak;
+    frame.mean = r->amp_n ? r->amp_sum / r->amp_n : 0;
+    msg_strength[i] = frame.mean;
+    reset_channel(i);
+
+    frame.len = len;
+    frame.src = r->bytes[0] >> DM_HDR_SRC_SHIFT;
+    frame.dst = r->bytes[0] & DM_HDR_DST_MASK;
+    frame.type = (r->bytes[1] & DM_HDR_TYPE_MASK) >> DM_HDR_TYPE_SHIFT;
+    frame.ttl = r->bytes[1] & DM_HDR_TTL_MASK;
+    frame.hops = r->bytes[2] >> DM_HDR_HOPS_SHIFT;
+    frame.seq = r->bytes[2] & DM_HDR_SEQ_MASK;
+
+    // Link works at least at this rate in the other direction (relayed frame wasn't sent by its sender)
+    dm_link_t *link = ((frame.src != ROBOT_ID) && !frame.hops) ? get_link(frame.src) : NULL;
+    if (link) {
+        link->last_heard = esp_timer_get_time();
+        if (r->rate >= link->rate) dm_comm_rate_report(frame.src, true);
+        rx_strength_save(link, i, frame.seq, frame.peak, frame.mean);
+    }
 
-        if (j == 0) {
-            msg[i] = rx_bit ? 0 : 1;
-        } else {
-            rx_bit_prev = (rx_buffer[i] >> ((2 * MSG_LENGTH - 1) - (j - 1))) & 1;
-            msg[i] = (msg[i] << 1) | (rx_bit == rx_bit_prev);
-        }
+    memcpy(frame.payload, &r->bytes[DM_HEADER_LEN], len);
+    frame.channel = i;
+    frame.rate = r->rate;
+    frame.time_us = esp_timer_get_time();
+
+    if (frame.type == DM_TYPE_ACK) {
+        if (frame.dst == ROBOT_ID) tx_ack_received(frame.src, frame.seq);
+        return;
+    }
+
+    // Beacons are used only for TDMA timing
+    if (frame.type == DM_TYPE_BEACON) {
+        #if DM_TDMA
+        tdma_beacon();
+        #endif
+        return;
     }
 
-    start_detected[i] = 0;
-    rx_count[i] = 0;
-    rx_buffer[i] = 0;
+    if ((frame.dst != DM_ADDR_BROADCAST) && (frame.dst != ROBOT_ID)) return;
+
+    // Own frame relayed back
+    if ((frame.src == ROBOT_ID) && frame.hops) return;
+
+    if ((frame.type == DM_TYPE_DATA) && (frame.dst == ROBOT_ID)) tx_send_ack(frame.src, frame.seq);
+
+    if ((frame.type == DM_TYPE_DATA) && (frame.dst == DM_ADDR_BROADCAST) && frame.ttl && (frame.src != ROBOT_ID)) {
+        relay_push(&frame);
+    }
+
+    rx_queue_push(&rx_queue[i], &frame);
 }
 
 bool dm_comm_process() {
     bool any_processed = false;
-    
-    dm_comm_detect_start_sig();
+    dm_frame_t frame;
 
+    // One frame from each channel, the rest stays queued for next call
     for (int i = 0; i < CHANNEL_NUM; i++) {
-        if (start_detected[i] && rx_count[i] == 2 * MSG_LENGTH) {
-            decode_channel(i);
+        while (rx_queue_pop(&rx_queue[i], &frame)) {
+            // Relayed frame doesn't come from direction of its sender
+            if (frame.hops) continue;
+            // Frame is counted once per channel, copies on other channels keep the direction
+            if (seen_check(proc_seen[i], &frame)) {
+                rx_duplicates++;
+                continue;
+            }
+            msg[i] = frame.len ? frame.payload[0] : 0;
             any_processed = true;
+            break;
         }
     }
 
     return any_processed;
 }
 
+bool dm_comm_wait_frame(dm_frame_t *frame, uint32_t timeout_ms) {
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = (timeout_ms == DM_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    bool received;
 
-bool dm_comm_detect_signals(void) {
-    //printf("\ndm_comm reading");
-    adc_lib_read_all(sig_adc1_results, sig_adc2_results);
-    vTaskDelay(pdMS_TO_TICKS(10)); // there has to be delay at 10 ms, otherwise crashes
-    for (int i = 0; i < adc1_size; i++)
-    {
-        if (sig_adc1_results[i] >= SIG_THRESHOLD) return true;
+    rx_waiter = xTaskGetCurrentTaskHandle();
+
+    // Notification left from an earlier frame only causes one more check
+    while (!(received = dm_comm_recv_frame(frame))) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if ((wait != portMAX_DELAY) && (elapsed >= wait)) break;
+        ulTaskNotifyTake(pdTRUE, (wait == portMAX_DELAY) ? portMAX_DELAY : wait - elapsed);
     }
 
-    for (int i = 0; i < adc2_size; i++) {
-        if (sig_adc2_results[i] >= SIG_THRESHOLD) return true;
+    rx_waiter = NULL;
+    return received;
+}
+
+uint32_t dm_comm_get_rx_duplicates(void) {
+    return rx_duplicates;
+}
+
+uint32_t dm_comm_get_rx_dropped(void) {
+    uint32_t dropped = 0;
+    for (int i = 0; i < CHANNEL_NUM; i++) dropped += rx_queue[i].dropped;
+    return dropped;
+}
+
+
+bool dm_comm_detect_signals(void) {
+    int signals[CHANNEL_NUM];
+
+    sense_wait(signals);
+    for (int i = 0; i < adc1_size + adc2_size; i++) {
+        if (signals[i] >= SIG_THRESHOLD) return true;
     }
     return false;
 }
 
 void dm_comm_get_signals(int adc_results[CHANNEL_NUM]){
-    adc_lib_read_all(sig_adc1_results, sig_adc2_results);
-    for (int i = 0; i < adc1_size; i++)
-    {
-        adc_results[i] = sig_adc1_results[i];
-    }
-
-    for (int i = 0; i < adc2_size; i++) {
-        adc_results[i + adc1_size] = sig_adc2_results[i];
-    }
-    vTaskDelay(pdMS_TO_TICKS(10)); // there has to be delay at 10 ms, otherwise crashes
+    sense_wait(adc_results);
 }
 
 void dm_comm_get_messages(int rx_msg[CHANNEL_NUM]) {
@@ -339,13 +1706,124 @@ void dm_comm_get_messages(int rx_msg[CHANNEL_NUM]) {
 }
 
 void dm_comm_get_msg_strength(int adc_results[CHANNEL_NUM]){
-    for (int i = 0; i < adc1_size; i++)
+    for (int i = 0; i < CHANNEL_NUM; i++)
     {
-        adc_results[i] = adc1_results[i];
+        adc_results[i] = msg_strength[i];
+    }
+}
+
+bool dm_comm_get_frame_strength(uint8_t src, int peak[CHANNEL_NUM], int mean[CHANNEL_NUM]) {
+    dm_link_t *link = get_link(src);
+    bool found = false;
+
+    if (!link) return false;
+
+    portENTER_CRITICAL(&link_lock);
+    if (link->strength_time && (esp_timer_get_time() - link->strength_time <= DM_PEER_TIMEOUT_US)) {
+        for (int i = 0; i < CHANNEL_NUM; i++) {
+            peak[i] = link->peak[i];
+            mean[i] = link->mean[i];
+        }
+        found = true;
+    }
+    portEXIT_CRITICAL(&link_lock);
+
+    return found;
+}
+
+void dm_comm_get_thresholds(int floor[CHANNEL_NUM], int threshold[CHANNEL_NUM]) {
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        floor[i] = rx_slicer[i].floor >> DM_LEVEL_FRAC;
+        threshold[i] = rx_slicer[i].threshold;
+    }
+}
+
+void dm_comm_get_stats(dm_stats_t *stats) {
+    stats->time_us = esp_timer_get_time();
+    stats->fec_corrected = 0;
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        stats->channel[i] = rx_stats[i];
+        stats->channel[i].dropped = rx_queue[i].dropped;
+        stats->fec_corrected += rx_stats[i].fec_corrected;
+    }
+    stats->duplicates = rx_duplicates;
+    stats->tx_frames = tx_frames;
+    stats->csma_deferrals = csma_deferrals;
+    stats->csma_collisions = csma_collisions;
+    stats->csma_dropped = csma_dropped;
+    stats->ack_retransmits = ack_retransmits;
+    stats->ack_failed = ack_failed;
+    stats->relay_sent = relay_sent;
+    stats->relay_suppressed = relay_suppressed;
+    stats->relay_dropped = relay_dropped;
+}
+
+void dm_comm_stats_dump(void) {
+    static dm_stats_t last;     // Previous dump
+    dm_stats_t now;
+    uint32_t frames = 0, starts = 0;
+
+    dm_comm_get_stats(&now);
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        dm_channel_stats_t *c = &now.channel[i];
+        ESP_LOGI("dm_comm", "ch%d: start %" PRIu32 " ok %" PRIu32 " crc %" PRIu32 " fec %" PRIu32 " abort %" PRIu32 " drop %" PRIu32,
+                 i, c->start_sigs, c->frames, c->crc_errors, c->fec_errors, c->aborted, c->dropped);
+        frames += c->frames - last.channel[i].frames;
+        starts += c->start_sigs - last.channel[i].start_sigs;
+    }
+    ESP_LOGI("dm_comm", "tx %" PRIu32 ", csma def %" PRIu32 " col %" PRIu32 " drop %" PRIu32 ", ack retx %" PRIu32 " fail %" PRIu32
+             ", relay %" PRIu32 " supp %" PRIu32 " drop %" PRIu32 ", dup %" PRIu32 ", fec fixed %" PRIu32,
+             now.tx_frames, now.csma_deferrals, now.csma_collisions, now.csma_dropped, now.ack_retransmits, now.ack_failed,
+             now.relay_sent, now.relay_suppressed, now.relay_dropped, now.duplicates, now.fec_corrected);
+
+    int64_t dt = now.time_us - last.time_us;
+    if (last.time_us && dt > 0) {
+        ESP_LOGI("dm_comm", "last %" PRId64 " ms: %" PRIu32 " frames (%" PRIu32 "/s), %" PRIu32 " of %" PRIu32 " START_SIG decoded",
+                 dt / 1000, frames, (uint32_t)(frames * 1000000LL / dt), frames, starts);
+    }
+    last = now;
+
+    hwtimer_profile_dump();     // Interrupt times (with HWTIMER_PROFILE)
+}
+
+void dm_comm_rate_report(uint8_t id, bool ok) {
+    dm_link_t *link = get_link(id);
+    if (!link) return;
+
+    // Called from timer interrupt, DMA task and user tasks
+    portENTER_CRITICAL_SAFE(&link_lock);
+    if (!ok) {
+        if (link->rate > 0) link->rate--;
+        link->streak = 0;
+    } else if (++link->streak >= DM_RATE_UP_STREAK) {
+        if (link->rate + 1 < DM_RATE_COUNT) link->rate++;
+        link->streak = 0;
     }
+    portEXIT_CRITICAL_SAFE(&link_lock);
+}
 
-    for (int i = 0; i < adc2_size; i++) {
-        adc_results[i + adc1_size] = adc2_results[i];
+uint8_t dm_comm_get_rate(uint8_t id) {
+    if (id != DM_ADDR_BROADCAST) {
+        dm_link_t *link = get_link(id);
+        return link ? link->rate : 0;
+    }
+
+    // Broadcast has to reach the slowest robot around
+    int64_t now = esp_timer_get_time();
+    uint8_t rate = DM_RATE_COUNT;
+    for (int j = 1; j < DM_MAX_ROBOTS; j++) {
+        if (links[j].last_heard == 0 || (now - links[j].last_heard) > DM_PEER_TIMEOUT_US) continue;
+        if (links[j].rate < rate) rate = links[j].rate;
+    }
+    return (rate == DM_RATE_COUNT) ? 0 : rate;
+}
+
+void dm_comm_get_fec_stats(uint32_t *corrected, uint32_t *failed) {
+    *corrected = 0;
+    *failed = 0;
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+        *corrected += rx_stats[i].fec_corrected;
+        *failed += rx_stats[i].fec_errors;
     }
 }
 
@@ -354,6 +1832,45 @@ bool dm_comm_backoff(){
 }
 
 void dm_comm_set_backoff(int backoff){
+    backoff_countdown = backoff * CYCLE_BIT_COUNT * DM_OVERSAMPLE;
     backoff_active = 1; 
-    backoff_countdown = backoff * CYCLE_BIT_COUNT;
+}
+
+void dm_comm_tdma_master(bool master) {
+    #if DM_TDMA
+    dm_frame_t beacon = {
+        .dst = DM_ADDR_BROADCAST,
+        .type = DM_TYPE_BEACON,
+        .len = 0,
+    };
+
+    // Beacon is always the same, base rate so everyone can hear it
+    tx_load(&tx_beacon, &beacon, 0);
+    tdma_master = master;
+    #endif
+}
+
+bool dm_comm_tdma_synced(void) {
+    #if DM_TDMA
+    return tdma_synced();
+    #else
+    return false;
+    #endif
+}
+
+void dm_comm_get_ack_stats(uint32_t *retransmits, uint32_t *failed) {
+    *retransmits = ack_retransmits;
+    *failed = ack_failed;
+}
+
+void dm_comm_get_relay_stats(uint32_t *relayed, uint32_t *suppressed, uint32_t *dropped) {
+    *relayed = relay_sent;
+    *suppressed = relay_suppressed;
+    *dropped = relay_dropped;
+}
+
+void dm_comm_get_csma_stats(uint32_t *deferrals, uint32_t *collisions, uint32_t *dropped) {
+    *deferrals = csma_deferrals;
+    *collisions = csma_collisions;
+    *dropped = csma_dropped;
 }
\ No newline at end of file
@@ -4,17 +4,30 @@
  * Includes sending and receiving messages. 
  * Messages are received continuously with chosen interval.
  * 
+ * Messages are sent as frames with header and CRC (see "Frame format"),
+ * decoded in timer interrupt and queued per channel. Channel access is
+ * CSMA/CA or TDMA, frames to one robot are acknowledged and commands
+ * are relayed by robots which hear them.
+ * 
  */
 
 
 #ifndef DM_COMM_H
 #define DM_COMM_H
 
+// C/C++ libraries
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
 // ESP-IDF libraries
 #include "driver/gpio.h"
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_random.h"
+#include "driver/rmt_tx.h"
 
 // Personal libraries
 #include "io_define.h"
@@ -23,18 +36,197 @@
 #include "led_driver.h"
 
 
-#define MSG_LENGTH 4            // Number of bits per message
+// Every channel is sampled DM_OVERSAMPLE times per half-bit, sampling window of each
+// channel is moved by received edges (clock recovery), majority of window decides
 #define BIT_DURATION_US 1000    // Duration of half clock cycle (for Differential Manchester encoding)
+#define DM_CARRIER      0       // HIGH half-bits are sent as IR carrier and demodulated by receiver
+#define DM_OVERSAMPLE   (DM_CARRIER ? 8 : 4)    // Samples per half-bit (1 = sample once, no clock recovery)
+#define DM_TICK_US      (BIT_DURATION_US / DM_OVERSAMPLE)   // Period of timer interrupt
 #define SIG_THRESHOLD 500       // If higher read as "1" (HIGH)
 #define START_SIG 0b1110        // Sent before every msg (for synchronisation)
 #define START_SIG_LEN 4         // Number of bits for START_SIG
+#define DM_START_MASK ((1 << (START_SIG_LEN + 1)) - 1)     // START_SIG and LOW half-bit before it
+
+// Adaptive threshold, floor follows LOW samples and peak HIGH samples of each channel, so
+// ambient light, gain and distance don't need fixed SIG_THRESHOLD
+// (levels in fixed point with DM_LEVEL_FRAC bits, EWMA with 1/2^shift)
+#define DM_ADAPTIVE_THRESHOLD   1       // Threshold of each channel follows its noise floor and peak (else DM_RX_THRESHOLD)
+#define DM_THRESHOLD_MARGIN     250     // Lowest threshold above noise floor
+#define DM_THRESHOLD_SHIFT      2       // Threshold at 1/4 from floor to peak (weaker sender right after stronger one)
+#define DM_LEVEL_FRAC           10
+#define DM_FLOOR_FALL_SHIFT     2       // Floor follows darker samples at once
+#define DM_FLOOR_RISE_SHIFT     10      // and brighter ambient light in ~1000 samples
+#define DM_PEAK_RISE_SHIFT      1
+#define DM_PEAK_FALL_SHIFT      8       // Peak decays to floor in ~250 samples without signal
+
+// Modulated IR (DM_CARRIER), amplitude from quadrature differences of last DM_CARRIER_TICKS
+// samples doesn't depend on phase and cancels ambient light and obstacle LED
+#define DM_CARRIER_TICKS        4       // Timer ticks per carrier period (quadrature needs 4 samples)
+#define DM_CARRIER_HZ           (1000000 / (DM_CARRIER_TICKS * DM_TICK_US))
+#define DM_CARRIER_THRESHOLD    250     // Demodulated amplitude read as HIGH (ambient light removed)
+
+#if DM_CARRIER
+    #define DM_RX_THRESHOLD     DM_CARRIER_THRESHOLD
+    #if DM_OVERSAMPLE < 2 * DM_CARRIER_TICKS
+        #error "DM_CARRIER needs at least 2 carrier periods per half-bit"
+    #endif
+#else
+    #define DM_RX_THRESHOLD     SIG_THRESHOLD
+#endif
+
+// Timer interrupt is a job of timer wheel (hwtimer.h), ticks finer than the wheel
+// (DM_CARRIER) get own gptimer
+#define DM_TIMER_ID             1       // gptimer of timer interrupt (hwtimer_init) if not a wheel job
+#define DM_OWN_TIMER            ((DM_TICK_US % HWTIMER_WHEEL_TICK_US) != 0)
+
+// Bit rate adaptation, START_SIG and rate field are sent at base rate, the rest at rate
+// of the link (broadcast at the lowest rate of robots heard recently)
+// Timer ticks per half-bit for rates 0 (BIT_DURATION_US) to DM_RATE_COUNT-1,
+// clock recovery needs at least 3 samples per half-bit, demodulation 2 carrier periods.
+// With DM_OVERSAMPLE 4 there are only 4 and 3 ticks, the fastest half-bit is 750us
+#define DM_MIN_HALF_TICKS       (DM_CARRIER ? 2 * DM_CARRIER_TICKS : 3)
+#if DM_OVERSAMPLE / 2 >= DM_MIN_HALF_TICKS
+    #define DM_RATE_COUNT       3
+    #define DM_RATE_TICKS       {DM_OVERSAMPLE, 3 * DM_OVERSAMPLE / 4, DM_OVERSAMPLE / 2}
+#elif 3 * DM_OVERSAMPLE / 4 >= DM_MIN_HALF_TICKS
+    #define DM_RATE_COUNT       2
+    #define DM_RATE_TICKS       {DM_OVERSAMPLE, 3 * DM_OVERSAMPLE / 4}
+#else
+    #define DM_RATE_COUNT       1
+    #define DM_RATE_TICKS       {DM_OVERSAMPLE}
+#endif
+#define DM_RATE_UP_STREAK       8       // Frames without error before rate is raised
+#define DM_MAX_ROBOTS           16      // Robot IDs 1 to DM_MAX_ROBOTS-1 are tracked
+#define DM_PEER_TIMEOUT_US      (5 * 1000000)   // Robot not heard for this long is ignored for broadcast rate
+#define DM_STRENGTH_MERGE_US    (4 * BIT_DURATION_US)   // Frames on different channels ending this close are one frame
+
+// Receive queues and CSMA/CA (colliding frame is retried after backoff from doubled window)
+#define DM_RX_QUEUE_LEN         8       // Received frames kept per channel (power of 2)
+#define DM_DEDUP_DEPTH          4       // Sequence numbers remembered per sender
+#define DM_DEDUP_TIMEOUT_US     (2 * 1000000)   // Sender not heard for this long is forgotten (e.g. restarted)
+#define DM_CSMA_IDLE_TICKS      (4 * DM_OVERSAMPLE)     // Idle time before sending, longer than any DM run (3 half-bits)
+#define DM_CSMA_SLOT_TICKS      (START_SIG_LEN * DM_OVERSAMPLE)  // Backoff slot
+#define DM_CSMA_CW_MIN          4       // Backoff slots are chosen from [0, CW)
+#define DM_CSMA_CW_MAX          64
+#define DM_CSMA_MAX_RETRIES     5       // Collisions before frame is dropped
+#define DM_CSMA_MAX_WAIT_TICKS  (1000000 / DM_TICK_US)  // Frame waiting for channel longer than 1s is dropped
+#define DM_CSMA_COLLISION_SAMPLES   2   // HIGH samples while own LED is LOW to detect collision
+
+// Acknowledgement, DATA frames to one robot are answered after SIFS without carrier sense
+#define DM_ACK_SIFS_TICKS       (2 * DM_OVERSAMPLE)     // Gap between frame and its ACK
+#define DM_ACK_TIMEOUT_TICKS    (DM_ACK_SIFS_TICKS + DM_FRAME_HALF_BITS(0) * DM_OVERSAMPLE + 4 * DM_OVERSAMPLE)  // ACK is sent at base rate
+#define DM_ACK_MAX_RETRIES      3       // Retransmissions before frame is given up
+
+// Relay (flooding), first copy of broadcast frame with TTL is sent again after random delay
+#define DM_RELAY_TTL_MAX        DM_HDR_TTL_MASK
+#define DM_CMD_TTL              DM_RELAY_TTL_MAX        // Relays of commands sent with dm_comm_send_cmd()
+#define DM_RELAY_QUEUE_LEN      4       // Frames waiting to be relayed
+#define DM_RELAY_DELAY_TICKS    (DM_CSMA_IDLE_TICKS)    // Shortest wait before relaying
+#define DM_RELAY_JITTER_TICKS   (DM_CSMA_CW_MAX * DM_CSMA_SLOT_TICKS)  // Random part of wait, spreads robots which heard the same frame
+
+// TDMA
+#define DM_TDMA                 0       // Superframes with slot for each robot, started by leader beacon
+#define DM_TDMA_SLOTS           4       // Robot slots in superframe, one per robot (ROBOT_ID 1 to 4 in io_define.h)
+#define DM_TDMA_OWN_SLOT        ((ROBOT_ID - 1) % DM_TDMA_SLOTS)
+#define DM_TDMA_SLOT_PAYLOAD    1       // Payload of frames the slot is sized for (commands)
+#define DM_TDMA_SLOT_FRAMES     4       // Frames sent one after another in own slot (base rate)
+#define DM_TDMA_GUARD_TICKS     (4 * DM_OVERSAMPLE)     // Gap after each slot (sync error)
+#define DM_TDMA_FRAME_TICKS(len)    (DM_FRAME_HALF_BITS(len) * DM_OVERSAMPLE)  // Frame length at base rate
+#define DM_TDMA_BEACON_TICKS    (DM_TDMA_FRAME_TICKS(0) + DM_TDMA_GUARD_TICKS)
+#define DM_TDMA_SLOT_TICKS      (DM_TDMA_SLOT_FRAMES * DM_TDMA_FRAME_TICKS(DM_TDMA_SLOT_PAYLOAD) + DM_ACK_TIMEOUT_TICKS + DM_TDMA_GUARD_TICKS)  // Frames, ACK of the last one
+#define DM_TDMA_SUPERFRAME_TICKS    (DM_TDMA_BEACON_TICKS + DM_TDMA_SLOTS * DM_TDMA_SLOT_TICKS)
+#define DM_TDMA_SYNC_LOST       3       // Superframes without beacon before going back to CSMA/CA
+
+// ADC1 channels with ADC_LIB_DMA (adc_lib.h) are decoded in a task, not while sending
+#define DM_ADC_DMA_DECIMATE     4       // DMA conversions per sample (ADC_LIB_DMA)
+#define DM_DMA_TIMEOUT_MS       10      // Longest wait for DMA frame
+#define DM_DMA_TASK_STACK       4096
+#define DM_DMA_TASK_PRIORITY    (configMAX_PRIORITIES - 2)
+
+// Tasks (interrupts run on the core they are set up from)
+#define DM_CORE                 0       // Core of interrupts and tasks, dm_comm_init() has to run on it
+#define DM_LOG_CORE             (portNUM_PROCESSORS - 1)    // Core of statistics dump (DM_STATS_DUMP_MS)
+#define DM_LOG_TASK_STACK       4096
+#define DM_LOG_TASK_PRIORITY    (tskIDLE_PRIORITY + 1)
+#define DM_SENSE_TASK_STACK     2048
+#define DM_SENSE_TASK_PRIORITY  (configMAX_PRIORITIES - 3)
+
+// RMT transmitter, nothing is received and collisions are not detected while sending
+#define DM_TX_RMT               0       // Frames are sent by RMT peripheral instead of timer interrupt
+#define DM_RMT_MAX_LEDS         2       // LEDs driven by RMT (one channel each)
+#define DM_RMT_MEM_SYMBOLS      64      // RMT memory per channel, longer frames are refilled by driver
+#define DM_RMT_MAX_SYMBOLS      (DM_FRAME_HALF_BITS(DM_FRAME_MAX_PAYLOAD) / 2 + 2)  // 2 runs per symbol, run is at least 1 half-bit
+#define DM_RMT_TASK_STACK       4096
+#define DM_RMT_TASK_PRIORITY    (configMAX_PRIORITIES - 1)
+
+#define DM_WAIT_FOREVER         UINT32_MAX  // dm_comm_wait_frame() timeout without limit
+#define DM_STATS_DUMP_MS        0       // Statistics are logged with this period (0 = only by dm_comm_stats_dump)
+
+// Frame format, after START_SIG and rate field all bytes are sent MSB first:
+//   sender, destination | length, type, TTL | hops, seq | payload | CRC-8
+// Back-to-back goodput is 85 bit/s (1 byte) to 193 bit/s (15 bytes, FEC) at base rate and
+// up to ~255 bit/s at 750us, the old 4-bit commands had 333 bit/s of airtime
+#define DM_FRAME_MAX_PAYLOAD    15      // Maximum number of payload bytes in one frame (4 bit length)
+#define DM_HEADER_LEN           3       // Sender and destination, length, type and TTL, hops and seq
+#define DM_CRC_LEN              1       // CRC-8 after payload
+#define DM_ADDR_BROADCAST       0       // Destination ID received by every robot (not a robot ID)
+#define DM_CRC_POLY             0x07    // CRC-8 polynomial (x^8 + x^2 + x + 1)
+
+// Header bytes (DATA frames to one robot ask for ACK, there is no flag for it)
+#define DM_HDR_SRC_SHIFT        4       // Byte 0: sender ID | destination ID
+#define DM_HDR_DST_MASK         0x0F
+#define DM_HDR_LEN_SHIFT        4       // Byte 1: length | type | TTL
+#define DM_HDR_TYPE_MASK        0x0C
+#define DM_HDR_TYPE_SHIFT       2
+#define DM_HDR_TTL_MASK         0x03    // Relays left (broadcast DATA frames)
+#define DM_HDR_HOPS_SHIFT       6       // Byte 2: hops | seq, times frame was relayed already
+#define DM_HDR_SEQ_MASK         0x3F
+
+#define DM_TYPE_DATA            0
+#define DM_TYPE_BEACON          1       // TDMA superframe start (not passed to user)
+#define DM_TYPE_ACK             2       // Frame was received (not passed to user)
+
+#if (ROBOT_ID == DM_ADDR_BROADCAST) || (ROBOT_ID > DM_HDR_DST_MASK)
+    #error "ROBOT_ID has to fit in 4 bits of header (1 to 15)"
+#endif
 
-#define CYCLE_BIT_COUNT     (2*MSG_LENGTH + START_SIG_LEN)      // Total number of bits per sent/received message
+// Forward error correction, single bit errors of each nibble are corrected. Short frames
+// (commands, beacons, ACK) are sent without it, a flag in rate field tells which is used
+#define DM_FEC_NONE             0
+#define DM_FEC_HAMMING          1       // Extended Hamming(8,4), 2 codewords per byte
+#define DM_FEC                  DM_FEC_HAMMING
+#define DM_FEC_MIN_PAYLOAD      2       // Shorter frames are sent without FEC (CRC still finds errors)
+
+#if DM_FEC == DM_FEC_HAMMING
+    #define DM_FEC_RATIO        2       // Sent bytes per frame byte
+    #define DM_RATE_LEN         6       // Half-bits of rate field (2 bits rate, FEC flag, sent with base rate)
+#else
+    #define DM_FEC_RATIO        1
+    #define DM_RATE_LEN         4       // Half-bits of rate field (2 bits, sent with base rate)
+#endif
+
+#define DM_FEC_USED(len)        ((DM_FEC_RATIO > 1) && ((len) >= DM_FEC_MIN_PAYLOAD))
+#define DM_FRAME_BYTES(len)     (DM_HEADER_LEN + (len) + DM_CRC_LEN)            // Bytes after START_SIG
+#define DM_CODED_BYTES(len)     ((DM_FEC_USED(len) ? DM_FEC_RATIO : 1) * DM_FRAME_BYTES(len))   // Sent bytes after START_SIG
+#define DM_FRAME_HALF_BITS(len) (START_SIG_LEN + DM_RATE_LEN + 16 * DM_CODED_BYTES(len))    // Half-bits of whole frame (base rate)
+#define DM_MAX_FRAME_BYTES      DM_FRAME_BYTES(DM_FRAME_MAX_PAYLOAD)
+#define DM_MAX_CODED_BYTES      DM_CODED_BYTES(DM_FRAME_MAX_PAYLOAD)
+
+#define CYCLE_BIT_COUNT     DM_FRAME_HALF_BITS(1)               // Total number of bits per sent/received command (1 byte frame)
 #define MSG_INTERVAL        (CYCLE_BIT_COUNT* 2)                // Wait time before sending next message
+#define CMD_INTERVAL        (CYCLE_BIT_COUNT + (DM_CSMA_IDLE_TICKS + DM_CSMA_CW_MIN * DM_CSMA_SLOT_TICKS) / DM_OVERSAMPLE)   // Command repetitions, airtime and CSMA wait
 
 #define MSG_TIME_TAKEN      (MSG_INTERVAL * BIT_DURATION_US)    
-#define MAX_SEND_COUNT      5 * 1000000/MSG_TIME_TAKEN       // sending for 5s
-#define COMMAND_COUNT       3               // Least ammount of received COMMAND_SIG to commence
+
+// Commands are checked with CRC, noise can't make one up
+#define COMMAND_COUNT       2               // Least ammount of received COMMAND_SIG to commence (different transmissions)
+
+// Repetitions follow frame error rate, set it from dm_comm_stats_dump() of the worst
+// robot (100 - 100 * decoded / START_SIG), with 50 it's 16 commands and 8 starts (~2.6s)
+#define CMD_FRAME_ERROR_PCT 50      // Frames lost per 100 sent
+#define CMD_SEND_MARGIN     4       // Frames sent per frame expected to get through
+#define CMD_START_COUNT     (CMD_SEND_MARGIN * 100 / (100 - CMD_FRAME_ERROR_PCT))   // Repetitions of CMD_START_SIG (one is enough)
+#define MAX_SEND_COUNT      (COMMAND_COUNT * CMD_START_COUNT)                       // Repetitions of COMMAND_SIG
 
 #define COMMAND1_SIG        0b0001      // Message for commencing COMMAND1
 #define COMMAND2_SIG        0b0010      // Message for commencing COMMAND2
@@ -46,7 +238,61 @@
 
 
 #define MIN_BACKOFF_CYCLE   (COMMAND_PERIOD + MAX_SEND_COUNT/2)
-#define MAX_BACKOFF_CYCLE   2 * 1000000 / (CYCLE_BIT_COUNT * BIT_DURATION_US)     // duration of backoff (MAX_BACKOFF_CYCLE * (2*MSG_LENGTH + START_SIG_LEN))
+#define MAX_BACKOFF_CYCLE   2 * 1000000 / (CYCLE_BIT_COUNT * BIT_DURATION_US)     // duration of backoff (MAX_BACKOFF_CYCLE * CYCLE_BIT_COUNT)
+
+
+// Result of last dm_comm_send_frame()
+typedef enum {
+    DM_TX_IDLE,
+    DM_TX_PENDING,          // Waiting for channel, sending or waiting for ACK
+    DM_TX_OK,               // Sent (and acknowledged if unicast)
+    DM_TX_FAILED,           // No ACK after retries, too many collisions or channel busy for too long
+} dm_tx_status_t;
+
+// Received or sent frame
+typedef struct {
+    uint8_t src;                            // Sender ID (ROBOT_ID of sender)
+    uint8_t dst;                            // Destination ID or DM_ADDR_BROADCAST
+    uint8_t type;                           // Frame type (DM_TYPE_*)
+    uint8_t seq;                            // Sequence number, 6 bits (set automatically for sending)
+    uint8_t ttl;                            // Relays left, broadcast DATA frames only (up to DM_RELAY_TTL_MAX)
+    uint8_t hops;                           // Times frame was relayed before it was received
+    uint8_t len;                            // Number of payload bytes
+    uint8_t payload[DM_FRAME_MAX_PAYLOAD];
+    uint8_t channel;                        // Channel the frame was received on (not sent)
+    uint8_t rate;                           // Rate the frame was received with (chosen automatically for sending)
+    int64_t time_us;                        // esp_timer_get_time() when frame was received
+    uint16_t peak;                          // Highest ADC value of the frame on its channel
+    uint16_t mean;                          // Mean ADC value of HIGH samples of the frame on its channel
+} dm_frame_t;
+
+// Receive counters of one channel
+typedef struct {
+    uint32_t start_sigs;                    // START_SIG detected (also noise)
+    uint32_t frames;                        // Frames decoded with correct CRC
+    uint32_t crc_errors;                    // Frames dropped for wrong CRC
+    uint32_t fec_errors;                    // Frames aborted on uncorrectable byte
+    uint32_t fec_corrected;                 // Bit errors corrected by FEC
+    uint32_t aborted;                       // Frames aborted on invalid rate field or length
+    uint32_t dropped;                       // Frames lost because receive queue was full
+} dm_channel_stats_t;
+
+// Link statistics (dm_comm_get_stats)
+typedef struct {
+    int64_t time_us;                        // esp_timer_get_time() of snapshot
+    dm_channel_stats_t channel[CHANNEL_NUM];
+    uint32_t duplicates;                    // Copies skipped by dm_comm_recv_frame()
+    uint32_t fec_corrected;                 // Bit errors corrected by FEC (all channels)
+    uint32_t tx_frames;                     // Frames sent to the end (also beacons and ACKs)
+    uint32_t csma_deferrals;
+    uint32_t csma_collisions;
+    uint32_t csma_dropped;
+    uint32_t ack_retransmits;
+    uint32_t ack_failed;
+    uint32_t relay_sent;
+    uint32_t relay_suppressed;
+    uint32_t relay_dropped;
+} dm_stats_t;
 
 
 /**
@@ -59,9 +305,21 @@
  * @param leds      LED pins
  * @param l_size    Number of LEDs
  * 
+ * Has to be called from a task running on DM_CORE.
  */
 void dm_comm_init(adc1_channel_t *adc1_ch, int a1_size, adc2_channel_t *adc2_ch, int a2_size, gpio_num_t *leds, int l_size);
 
+/**
+ * @brief Turn communication LEDs on or off
+ * 
+ * For signalling without frames (e.g. leader beacon),
+ * with DM_TX_RMT the pins belong to RMT.
+ * 
+ * @param on    "1" to turn LEDs on
+ * 
+ */
+void dm_comm_led_drive(bool on);
+
 /**
  * @brief Start timer interrupt for communication
  */
@@ -75,15 +333,104 @@ void dm_comm_stop(void);
 /**
  * @brief Send message
  * 
+ * Message is sent as broadcast frame with 1 byte of payload.
+ * Only one frame is sent at a time, message is not accepted
+ * while previous one still waits for channel or is on air.
+ * 
  * @param message   Message to be sent
  * 
+ * @return "1" if message was accepted, "0" if it has to be sent again later
+ */
+bool dm_comm_send(int message);
+
+/**
+ * @brief Send command
+ * 
+ * Like dm_comm_send(), but the frame is relayed by robots which
+ * hear it (DM_CMD_TTL hops). Only for commands (COMMANDx_SIG,
+ * CMD_START_SIG), periodic beacons would flood the channel.
+ * 
+ * @param message   Command to be sent
+ * 
+ * @return "1" if command was accepted, "0" if it has to be sent again later
+ */
+bool dm_comm_send_cmd(int message);
+
+/**
+ * @brief Send frame
+ * 
+ * Sender ID is filled with ROBOT_ID and seq with next sequence number. Frame is copied, so it
+ * can be reused right after the call.
+ * 
+ * Frame waits for free channel (CSMA/CA), it's sent from timer interrupt.
+ * 
+ * @param frame     Frame to be sent (dst, len and payload are used)
+ * 
+ * @return "1" if frame was accepted, "0" if still sending (or relaying), backoff is active or len is too long
+ */
+bool dm_comm_send_frame(const dm_frame_t *frame);
+
+/**
+ * @brief Get result of last sent frame
+ * 
+ * Unicast frames are done after ACK is received.
+ * 
+ * @return DM_TX_PENDING while sending, then DM_TX_OK or DM_TX_FAILED
+ */
+dm_tx_status_t dm_comm_tx_status(void);
+
+/**
+ * @brief Get received frame
+ * 
+ * Takes the oldest frame from receive queues, channels take turns.
+ * Copies of frames which were already returned are skipped (last
+ * DM_DEDUP_DEPTH seqs of every sender). Queues have one writer and
+ * one reader, so frames have to be read from one task.
+ * 
+ * @param frame     Received frame
+ * 
+ * @return "1" if frame was received
+ */
+bool dm_comm_recv_frame(dm_frame_t *frame);
+
+/**
+ * @brief Wait for received frame
+ * 
+ * Blocks calling task until a frame is received or timeout passes.
+ * Task notification (index 0) of calling task is used for waking up.
+ * 
+ * @param frame         Received frame
+ * @param timeout_ms    Longest wait in ms, DM_WAIT_FOREVER for no limit
+ * 
+ * @return "1" if frame was received, "0" on timeout
+ */
+bool dm_comm_wait_frame(dm_frame_t *frame, uint32_t timeout_ms);
+
+/**
+ * @brief Get number of lost frames
+ * 
+ * Frames are lost if receive queue of the channel is full.
+ * 
+ * @return Number of frames lost on all channels
+ */
+uint32_t dm_comm_get_rx_dropped(void);
+
+/**
+ * @brief Get number of duplicate frames
+ * 
+ * Copies of already returned frame (other channel, retransmission)
+ * are skipped by dm_comm_recv_frame() and dm_comm_process().
+ * 
+ * @return Number of skipped copies
  */
-void dm_comm_send(int message);
+uint32_t dm_comm_get_rx_duplicates(void);
 
 /**
  * @brief Stop reading 
  * 
  * There is a flag inside timer callback.
+ * Reading stops after the frame being sent and queued relays
+ * are sent, no new relays are queued meanwhile.
  */
 void dm_comm_reading_stop(void);
 
@@ -91,20 +438,17 @@ void dm_comm_reading_stop(void);
  * @brief Start reading 
  * 
  * There is a flag inside timer callback.
+ * Frames received or waiting to be relayed before reading
+ * was stopped are dropped.
  */
 void dm_comm_reading_start(void);
 
-/**
- * @brief Decode message from chosen channel
- * 
- * @param i    Chosen channel
- * 
- */
-void decode_channel(int i);
-
 /**
  * @brief Checks if START_SIG is detected 
  * 
+ * START_SIG is detected in timer interrupt, this only
+ * checks if it was detected since last call.
+ * 
  * @return If START_SIG detected return "1" (HIGH)
  */
 bool dm_comm_detect_start_sig();
@@ -112,7 +456,10 @@ bool dm_comm_detect_start_sig();
 /**
  * @brief Message is processed/decoded
  * 
- * Checks and tries to decode messages from all channels.
+ * Takes one received frame from each channel, first byte
+ * of payload is returned by dm_comm_get_messages(). Relayed frames
+ * are skipped, they don't come from direction of their sender, and
+ * so are copies of a frame already taken from the same channel.
  * 
  * @return If message decoded succesfully return "1" (HIGH)
  */
@@ -121,7 +468,8 @@ bool dm_comm_process(void);
 /**
  * @brief Checks if signal is detected 
  * 
- * Simply checks presence of signal.
+ * Simply checks presence of signal in a new snapshot of signals
+ * (waits for it, see dm_comm_get_signals()).
  * 
  * @return If signal higher than threshold return "1" (HIGH)
  */
@@ -130,6 +478,10 @@ bool dm_comm_detect_signals(void);
 /**
  * @brief Get signals from all channels
  * 
+ * Waits for a new snapshot of signals, so every call gives new values.
+ * ADC is read by dm_sense task on DM_CORE only when asked, into two
+ * buffers, so copying needs no lock.
+ * 
  * @param adc_results   Array for read signals
  * 
  */
@@ -146,19 +498,144 @@ void dm_comm_get_messages(int rx_msg[CHANNEL_NUM]);
 /**
  * @brief Get strength of message
  * 
- * This function was not tested properly.
- * It's supposed to to return strength 
- * of signals from decoded messages.
+ * Mean ADC value of HIGH samples of the last frame
+ * decoded on each channel.
  * 
- * @param adc_results   Array for read signals
+ * @param adc_results   Array for strength of messages
  * 
  */
 void dm_comm_get_msg_strength(int adc_results[CHANNEL_NUM]);
 
+/**
+ * @brief Get strength of last frame from robot on all channels
+ * 
+ * Amplitude is measured while the frame is decoded, channels which
+ * didn't decode it are 0. Relayed frames are not counted (they come
+ * from another robot).
+ * 
+ * @param src   ID of the sender
+ * @param peak  Highest ADC value on each channel
+ * @param mean  Mean ADC value of HIGH samples on each channel
+ * 
+ * @return "1" if frame from the robot was received in last DM_PEER_TIMEOUT_US
+ */
+bool dm_comm_get_frame_strength(uint8_t src, int peak[CHANNEL_NUM], int mean[CHANNEL_NUM]);
+
+/**
+ * @brief Get slicing threshold of all channels
+ * 
+ * Without DM_ADAPTIVE_THRESHOLD floor is 0 and threshold DM_RX_THRESHOLD.
+ * 
+ * @param floor         Noise floor of each channel
+ * @param threshold     Lowest sample read as HIGH on each channel
+ * 
+ */
+void dm_comm_get_thresholds(int floor[CHANNEL_NUM], int threshold[CHANNEL_NUM]);
+
+/**
+ * @brief Get statistics of communication
+ * 
+ * Counters are taken one by one while communication runs, they only
+ * grow (wrap around at UINT32_MAX).
+ * 
+ * @param stats     Snapshot of all counters
+ * 
+ */
+void dm_comm_get_stats(dm_stats_t *stats);
+
+/**
+ * @brief Log statistics of communication
+ * 
+ * Logs counters of every channel and changes since last dump
+ * (frames per second, frames decoded of START_SIG detected), with
+ * HWTIMER_PROFILE also latency and run time of timer interrupts.
+ * Has to be called from one task only.
+ */
+void dm_comm_stats_dump(void);
+
+/**
+ * @brief Report result of communication with robot
+ * 
+ * Rate for sending to the robot is raised after DM_RATE_UP_STREAK
+ * successes and lowered after failure. Received frames are reported
+ * automatically.
+ * 
+ * @param id    ID of the other robot
+ * @param ok    "1" if frame was delivered/decoded, "0" if it failed
+ * 
+ */
+void dm_comm_rate_report(uint8_t id, bool ok);
+
+/**
+ * @brief Get rate used for sending to robot
+ * 
+ * @param id    ID of the other robot or DM_ADDR_BROADCAST
+ * 
+ * @return Rate index (0 is the slowest)
+ */
+uint8_t dm_comm_get_rate(uint8_t id);
+
+/**
+ * @brief Get FEC counters
+ * 
+ * @param corrected     Number of corrected codewords
+ * @param failed        Number of frames dropped because of uncorrectable codeword
+ * 
+ */
+void dm_comm_get_fec_stats(uint32_t *corrected, uint32_t *failed);
+
+/**
+ * @brief Get ACK counters
+ * 
+ * @param retransmits   Number of frames sent again because ACK didn't come
+ * @param failed        Number of frames without ACK after DM_ACK_MAX_RETRIES
+ * 
+ */
+void dm_comm_get_ack_stats(uint32_t *retransmits, uint32_t *failed);
+
+/**
+ * @brief Get relay counters
+ * 
+ * @param relayed       Number of frames sent again
+ * @param suppressed    Number of copies not relayed because frame was relayed already
+ * @param dropped       Number of frames not relayed (queue full, collisions or busy channel)
+ * 
+ */
+void dm_comm_get_relay_stats(uint32_t *relayed, uint32_t *suppressed, uint32_t *dropped);
+
+/**
+ * @brief Make robot TDMA leader
+ * 
+ * Leader sends beacon at the start of every superframe, robots
+ * send only in their slot and go back to CSMA/CA without beacons.
+ * Does nothing without DM_TDMA.
+ * 
+ * @param master    "1" to send beacons
+ */
+void dm_comm_tdma_master(bool master);
+
+/**
+ * @brief Checks if robot sends in TDMA slots
+ * 
+ * @return "1" if beacon was heard recently (or robot is leader)
+ */
+bool dm_comm_tdma_synced(void);
+
+/**
+ * @brief Get CSMA/CA counters
+ * 
+ * @param deferrals     Number of frames which found channel busy
+ * @param collisions    Number of collisions while sending
+ * @param dropped       Number of frames dropped (too many collisions or busy channel)
+ * 
+ */
+void dm_comm_get_csma_stats(uint32_t *deferrals, uint32_t *collisions, uint32_t *dropped);
+
 /**
  * @brief Checks if robot is waiting for backoff time 
  * 
- * It's for CSMA/CA. The robot can't send messages if 
+ * Backoff set by dm_comm_set_backoff(), CSMA/CA backoff is
+ * handled inside. The robot can't send messages if 
  * backoff is active.
  * 
  * @return Returns state of backoff flag
@@ -168,7 +645,7 @@ bool dm_comm_backoff(void);
 /**
  * @brief Sets backoff time
  * 
- * @param backoff   Backoff time
+ * @param backoff   Backoff time (in CYCLE_BIT_COUNT half-bits)
  * 
  */
 void dm_comm_set_backoff(int backoff);
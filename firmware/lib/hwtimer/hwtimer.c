@@ -4,15 +4,159 @@ static const char* TAG = "hwtimer_lib";
 static gptimer_handle_t gptimers[MAX_TIMERS] = { NULL };
 static timer_callback_t user_callbacks[MAX_TIMERS] = { NULL };
 
-static uint32_t clock_period = 0;
-static uint32_t clock_command = 0;
+// Timer wheel
+#define WHEEL_SLOTS     (1 << HWTIMER_WHEEL_BITS)
+#define WHEEL_LVL_SLOTS (1 << HWTIMER_WHEEL_LVL_BITS)
+
+static gptimer_handle_t wheel_timer = NULL;
+static hwtimer_job_t *wheel_first[WHEEL_SLOTS];                                     // Next ticks
+static hwtimer_job_t *wheel_levels[HWTIMER_WHEEL_LEVELS - 1][WHEEL_LVL_SLOTS];      // Later, by blocks of ticks
+static uint32_t wheel_tick = 0;         // Ticks of wheel, slots of this tick already ran
+static portMUX_TYPE wheel_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if HWTIMER_PROFILE
+static uint32_t timer_resolutions[MAX_TIMERS];
+static bool timer_reloads[MAX_TIMERS];          // Counter starts from 0 at alarm
+static hwtimer_profile_t timer_profiles[MAX_TIMERS];
+static hwtimer_profile_t wheel_profile;
+static hwtimer_job_t *profile_jobs = NULL;
+static portMUX_TYPE profile_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+
+// **************       Profiling       **************
+
+#if HWTIMER_PROFILE
+static void IRAM_ATTR hist_add(hwtimer_hist_t *hist, uint32_t time_us)
+{
+    uint32_t bucket = time_us / HWTIMER_PROFILE_BUCKET_US;
+    if (bucket >= HWTIMER_PROFILE_BUCKETS) bucket = HWTIMER_PROFILE_BUCKETS - 1;
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    if (time_us > hist->max_us) hist->max_us = time_us;
+}
+
+// Latency is given, execution lasts from start_cycles till now
+static void IRAM_ATTR profile_add(hwtimer_profile_t *profile, uint32_t latency_us, uint32_t start_cycles)
+{
+    uint32_t exec_us = (esp_cpu_get_cycle_count() - start_cycles) / esp_rom_get_cpu_ticks_per_us();
+
+    portENTER_CRITICAL_SAFE(&profile_lock);
+    hist_add(&profile->latency, latency_us);
+    hist_add(&profile->exec, exec_us);
+    portEXIT_CRITICAL_SAFE(&profile_lock);
+}
+
+static void profile_copy(hwtimer_profile_t *dst, const hwtimer_profile_t *src)
+{
+    portENTER_CRITICAL(&profile_lock);
+    *dst = *src;
+    portEXIT_CRITICAL(&profile_lock);
+}
+
+static void profile_log(const char *name, const hwtimer_profile_t *profile)
+{
+    ESP_LOGI(TAG, "%s: %" PRIu32 " calls, latency p50 %" PRIu32 " p99 %" PRIu32 " max %" PRIu32
+                  " us, exec p50 %" PRIu32 " p99 %" PRIu32 " max %" PRIu32 " us",
+             name, profile->exec.count,
+             hwtimer_hist_percentile(&profile->latency, 50), hwtimer_hist_percentile(&profile->latency, 99), profile->latency.max_us,
+             hwtimer_hist_percentile(&profile->exec, 50), hwtimer_hist_percentile(&profile->exec, 99), profile->exec.max_us);
+}
+#endif
+
+uint32_t hwtimer_hist_percentile(const hwtimer_hist_t *hist, int percent)
+{
+    if (!hist->count) return 0;
+
+    uint64_t target = ((uint64_t)hist->count * percent + 99) / 100;   // Rank of sample, rounded up
+    uint64_t sum = 0;
+    if (!target) target = 1;
+
+    for (int i = 0; i < HWTIMER_PROFILE_BUCKETS - 1; i++) {
+        sum += hist->buckets[i];
+        if (sum >= target) {
+            uint32_t bound = (i + 1) * HWTIMER_PROFILE_BUCKET_US - 1;
+            return (bound < hist->max_us) ? bound : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
+
+esp_err_t hwtimer_profile_get(int timer_id, hwtimer_profile_t *profile)
+{
+    if (timer_id < 0 || timer_id >= MAX_TIMERS) return ESP_ERR_INVALID_ARG;
+
+    #if HWTIMER_PROFILE
+    profile_copy(profile, &timer_profiles[timer_id]);
+    #else
+    memset(profile, 0, sizeof(*profile));
+    #endif
+    return ESP_OK;
+}
+
+void hwtimer_wheel_profile_get(hwtimer_profile_t *profile)
+{
+    #if HWTIMER_PROFILE
+    profile_copy(profile, &wheel_profile);
+    #else
+    memset(profile, 0, sizeof(*profile));
+    #endif
+}
+
+void hwtimer_job_profile_get(const hwtimer_job_t *job, hwtimer_profile_t *profile)
+{
+    #if HWTIMER_PROFILE
+    profile_copy(profile, &job->profile);
+    #else
+    memset(profile, 0, sizeof(*profile));
+    #endif
+}
+
+void hwtimer_profile_dump(void)
+{
+    #if HWTIMER_PROFILE
+    hwtimer_profile_t profile;
+    char name[32];
+
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (gptimers[i] == NULL) continue;
+        profile_copy(&profile, &timer_profiles[i]);
+        snprintf(name, sizeof(name), "timer %d", i);
+        profile_log(name, &profile);
+    }
+
+    if (wheel_timer == NULL) return;
+    profile_copy(&profile, &wheel_profile);
+    profile_log("wheel", &profile);
+
+    // Jobs are only added to the list, never removed
+    for (hwtimer_job_t *job = profile_jobs; job; job = job->profile_next) {
+        profile_copy(&profile, &job->profile);
+        snprintf(name, sizeof(name), "job %p", job->callback);
+        profile_log(name, &profile);
+    }
+    #endif
+}
+
+
+// **************       Timers       **************
 
 
 static bool IRAM_ATTR timer_callback(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx) 
 {
     int timer_id = (int)user_ctx;  // Retrieve timer ID from input
     if ((timer_id >= 0) && (timer_id < MAX_TIMERS) && (user_callbacks[timer_id])) {
+        #if HWTIMER_PROFILE
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        uint64_t late = timer_reloads[timer_id] ? edata->count_value : edata->count_value - edata->alarm_value;
+        #endif
+
         user_callbacks[timer_id]();  // Call user-defined function
+
+        #if HWTIMER_PROFILE
+        profile_add(&timer_profiles[timer_id], late * 1000000 / timer_resolutions[timer_id], start_cycles);
+        #endif
     }
     return true;
 }
@@ -30,6 +174,11 @@ esp_err_t hwtimer_init(int timer_id, uint32_t resolution, uint64_t timer_count,
     }
 
     user_callbacks[timer_id] = callback;  // Store user callback
+    #if HWTIMER_PROFILE
+    timer_resolutions[timer_id] = resolution;
+    timer_reloads[timer_id] = true;
+    memset(&timer_profiles[timer_id], 0, sizeof(hwtimer_profile_t));
+    #endif
     
     //   Configure GPTimer
     gptimer_config_t timer_config = {
@@ -120,6 +269,11 @@ esp_err_t hwtimer_once_init(int timer_id, uint32_t resolution, uint64_t timer_co
     }
 
     user_callbacks[timer_id] = callback;  // Store user callback
+    #if HWTIMER_PROFILE
+    timer_resolutions[timer_id] = resolution;
+    timer_reloads[timer_id] = false;
+    memset(&timer_profiles[timer_id], 0, sizeof(hwtimer_profile_t));
+    #endif
     
     //   Configure GPTimer
     gptimer_config_t timer_config = {
@@ -176,34 +330,220 @@ void hwtimer_once_start(int timer_id)
 }
 
 
-static void timer0_callback()
+// **************       Timer wheel       **************
+
+// Bit of wheel_tick where slots of level start
+static inline int wheel_shift(int level)
+{
+    return HWTIMER_WHEEL_BITS + (level - 1) * HWTIMER_WHEEL_LVL_BITS;
+}
+
+// Put job in the slot of its tick (called with wheel_lock)
+static void IRAM_ATTR wheel_add(hwtimer_job_t *job)
+{
+    uint32_t delta = job->expires - wheel_tick;
+    hwtimer_job_t **slot = NULL;
+
+    if (delta > HWTIMER_WHEEL_MAX_TICKS) {
+        delta = HWTIMER_WHEEL_MAX_TICKS;
+        job->expires = wheel_tick + delta;
+    }
+
+    if (delta < WHEEL_SLOTS) {
+        slot = &wheel_first[job->expires % WHEEL_SLOTS];
+    } else {
+        for (int level = 1; level < HWTIMER_WHEEL_LEVELS; level++) {
+            if ((level < HWTIMER_WHEEL_LEVELS - 1) && (delta >> wheel_shift(level + 1))) continue;
+            slot = &wheel_levels[level - 1][(job->expires >> wheel_shift(level)) % WHEEL_LVL_SLOTS];
+            break;
+        }
+    }
+
+    job->prev = NULL;
+    job->next = *slot;
+    if (job->next) job->next->prev = job;
+    *slot = job;
+    job->slot = slot;
+}
+
+// Take job out of its slot (called with wheel_lock)
+static void IRAM_ATTR wheel_remove(hwtimer_job_t *job)
+{
+    if (!job->slot) return;
+    if (job->prev) job->prev->next = job->next;
+    else *job->slot = job->next;
+    if (job->next) job->next->prev = job->prev;
+    job->slot = NULL;
+}
+
+// Jobs of one higher level slot are moved closer, returns slot index
+static int IRAM_ATTR wheel_cascade(int level)
+{
+    int index = (wheel_tick >> wheel_shift(level)) % WHEEL_LVL_SLOTS;
+    hwtimer_job_t *job = wheel_levels[level - 1][index];
+
+    wheel_levels[level - 1][index] = NULL;
+    while (job) {
+        hwtimer_job_t *next = job->next;
+        wheel_add(job);
+        job = next;
+    }
+    return index;
+}
+
+static bool IRAM_ATTR wheel_callback(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx)
+{
+    #if HWTIMER_PROFILE
+    uint32_t entry_cycles = esp_cpu_get_cycle_count();
+    uint32_t latency = edata->count_value - edata->alarm_value;
+    #endif
+
+    // Counter runs freely (timebase), alarm moves to next tick
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = edata->alarm_value + HWTIMER_WHEEL_TICK_US
+    };
+    gptimer_set_alarm_action(timer, &alarm_config);
+
+    portENTER_CRITICAL_ISR(&wheel_lock);
+    wheel_tick++;
+
+    // First level wrapped, next block of ticks comes from level above (and so on)
+    if (!(wheel_tick % WHEEL_SLOTS)) {
+        for (int level = 1; level < HWTIMER_WHEEL_LEVELS; level++) {
+            if (wheel_cascade(level)) break;
+        }
+    }
+
+    hwtimer_job_t **slot = &wheel_first[wheel_tick % WHEEL_SLOTS];
+    while (*slot) {
+        hwtimer_job_t *job = *slot;
+        wheel_remove(job);
+        if (job->period) {
+            job->expires += job->period;
+            wheel_add(job);
+        }
+
+        // Callback can start or stop jobs
+        portEXIT_CRITICAL_ISR(&wheel_lock);
+        #if HWTIMER_PROFILE
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        job->callback();
+        profile_add(&job->profile, latency + (start_cycles - entry_cycles) / esp_rom_get_cpu_ticks_per_us(), start_cycles);
+        #else
+        job->callback();
+        #endif
+        portENTER_CRITICAL_ISR(&wheel_lock);
+    }
+    portEXIT_CRITICAL_ISR(&wheel_lock);
+
+    #if HWTIMER_PROFILE
+    profile_add(&wheel_profile, latency, entry_cycles);
+    #endif
+
+    return true;
+}
+
+esp_err_t hwtimer_wheel_init(void)
 {
-    clock_period++;
-    clock_command++;
+    if (wheel_timer != NULL) return ESP_OK;
+
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000
+    };
+    if (gptimer_new_timer(&timer_config, &wheel_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create timer wheel");
+        wheel_timer = NULL;
+        return ESP_FAIL;
+    }
+
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = HWTIMER_WHEEL_TICK_US
+    };
+    gptimer_event_callbacks_t cbs = { .on_alarm = wheel_callback };
+    if ((gptimer_set_alarm_action(wheel_timer, &alarm_config) != ESP_OK) ||
+        (gptimer_register_event_callbacks(wheel_timer, &cbs, NULL) != ESP_OK)) {
+        ESP_LOGE(TAG, "Failed to set up timer wheel");
+        gptimer_del_timer(wheel_timer);
+        wheel_timer = NULL;
+        return ESP_FAIL;
+    }
+
+    ESP_ERROR_CHECK(gptimer_enable(wheel_timer));
+    ESP_ERROR_CHECK(gptimer_start(wheel_timer));
+    ESP_LOGI(TAG, "Timer wheel started with %d us tick", HWTIMER_WHEEL_TICK_US);
+
+    return ESP_OK;
 }
 
+void hwtimer_job_init(hwtimer_job_t *job, timer_callback_t callback)
+{
+    #if HWTIMER_PROFILE
+    // Job is added to list for hwtimer_profile_dump() once
+    bool listed = false;
+    hwtimer_job_t *profile_next = NULL;
+
+    portENTER_CRITICAL(&profile_lock);
+    for (hwtimer_job_t *j = profile_jobs; j; j = j->profile_next) {
+        if (j == job) listed = true;
+    }
+    if (listed) profile_next = job->profile_next;
+    memset(job, 0, sizeof(*job));
+    job->callback = callback;
+    job->profile_next = profile_next;
+    if (!listed) {
+        job->profile_next = profile_jobs;
+        profile_jobs = job;
+    }
+    portEXIT_CRITICAL(&profile_lock);
+    #else
+    memset(job, 0, sizeof(*job));
+    job->callback = callback;
+    #endif
+}
 
-esp_err_t hwtimer_clock_init(uint32_t resolution, uint64_t timer_count)
+esp_err_t hwtimer_job_start(hwtimer_job_t *job, uint32_t delay_us, uint32_t period_us)
 {
-    return hwtimer_init(CLOCK_TIMER, resolution, timer_count, timer0_callback);
+    if (!job->callback) return ESP_ERR_INVALID_ARG;
+    if (wheel_timer == NULL) {
+        esp_err_t err = hwtimer_wheel_init();
+        if (err != ESP_OK) return err;
+    }
+
+    uint32_t delay = (delay_us + HWTIMER_WHEEL_TICK_US - 1) / HWTIMER_WHEEL_TICK_US;
+
+    portENTER_CRITICAL_SAFE(&wheel_lock);
+    wheel_remove(job);
+    job->expires = wheel_tick + (delay ? delay : 1);    // Slot of this tick already ran
+    job->period = (period_us + HWTIMER_WHEEL_TICK_US - 1) / HWTIMER_WHEEL_TICK_US;
+    wheel_add(job);
+    portEXIT_CRITICAL_SAFE(&wheel_lock);
+
+    return ESP_OK;
 }
 
-uint32_t hwtimer_get_time()
+void hwtimer_job_stop(hwtimer_job_t *job)
 {
-    return clock_period;
+    portENTER_CRITICAL_SAFE(&wheel_lock);
+    wheel_remove(job);
+    portEXIT_CRITICAL_SAFE(&wheel_lock);
 }
 
-void hwtimer_reset_clock()
+
+uint64_t IRAM_ATTR hwtimer_get_us(void)
 {
-    clock_period = 0;
+    uint64_t count = 0;
+    if (wheel_timer != NULL) gptimer_get_raw_count(wheel_timer, &count);
+    return count;
 }
 
-uint32_t hwtimer_cmd_get_time()
+void hwtimer_stopwatch_start(hwtimer_stopwatch_t *stopwatch)
 {
-    return clock_command;
+    stopwatch->start_us = hwtimer_get_us();
 }
 
-void hwtimer_cmd_reset_clock()
+uint64_t hwtimer_stopwatch_elapsed_us(const hwtimer_stopwatch_t *stopwatch)
 {
-    clock_command = 0;
-}
\ No newline at end of file
+    return hwtimer_get_us() - stopwatch->start_us;
+}
@@ -5,6 +5,28 @@
  * I think ESP32 has just 4 timers, so MAX_TIMERS 
  * in hwtimer.c is set to 4. Adjust if needed/can.
  * 
+ * Timer wheel runs any number of periodic and one-shot jobs on one
+ * more hardware timer, which interrupts every HWTIMER_WHEEL_TICK_US.
+ * Jobs are kept in slots by the tick they run at: first level has a
+ * slot for each of next 2^HWTIMER_WHEEL_BITS ticks, every higher level
+ * has 2^HWTIMER_WHEEL_LVL_BITS slots, each as long as the whole level
+ * below. Jobs of higher level slot move down (cascade) when the level
+ * below wraps, so starting, stopping and running a job is O(1).
+ * Job structs are owned by the caller (no allocation), callbacks run in
+ * timer interrupt one after another.
+ * 
+ * Counter of the wheel timer is never reloaded (only its alarm moves
+ * on each tick), so it doubles as free-running 1 MHz timebase. Times
+ * are measured with stopwatches (start/elapsed), each one independent,
+ * instead of shared counters that have to be reset.
+ * 
+ * With HWTIMER_PROFILE each timer id, the wheel interrupt and every
+ * wheel job record how late they start after the alarm (latency) and
+ * how long they run (execution, from CPU cycle counter). Times go to
+ * histograms of fixed HWTIMER_PROFILE_BUCKET_US buckets, the last one
+ * collects everything longer, so p50/p99 are bucket upper bounds and
+ * only max is exact.
+ * 
  */
 
 
@@ -14,6 +36,7 @@
 
 // C/C++ libraries
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -23,14 +46,59 @@
 #include "driver/gptimer.h"
 #include "freertos/FreeRTOS.h"
 #include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
 
 
 #define MAX_TIMERS 4  // Adjust based on needs
-#define CLOCK_TIMER 0
+
+// Profiling of timer callbacks
+#define HWTIMER_PROFILE             0   // 1 - record latency and execution time of callbacks
+#define HWTIMER_PROFILE_BUCKETS     32
+#define HWTIMER_PROFILE_BUCKET_US   8   // Histograms cover 0-255 us, last bucket is everything longer
+
+// Timer wheel
+#define HWTIMER_WHEEL_TICK_US   250     // Period of wheel interrupt, jobs run on multiples of it
+#define HWTIMER_WHEEL_BITS      8       // First level: slot for each of next 256 ticks
+#define HWTIMER_WHEEL_LVL_BITS  6       // Higher levels: 64 slots
+#define HWTIMER_WHEEL_LEVELS    3
+#define HWTIMER_WHEEL_MAX_TICKS ((1UL << (HWTIMER_WHEEL_BITS + (HWTIMER_WHEEL_LEVELS - 1) * HWTIMER_WHEEL_LVL_BITS)) - 1)   // Longest delay (~262 s)
 
 
 typedef void (*timer_callback_t)(void);  // Function pointer type for user callback
 
+// Histogram of times
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t buckets[HWTIMER_PROFILE_BUCKETS];
+} hwtimer_hist_t;
+
+// Profile of one callback
+typedef struct {
+    hwtimer_hist_t latency;         // From alarm to start of callback
+    hwtimer_hist_t exec;            // Duration of callback
+} hwtimer_profile_t;
+
+// Job of timer wheel (fields are used by hwtimer only)
+typedef struct hwtimer_job {
+    struct hwtimer_job *next;
+    struct hwtimer_job *prev;
+    struct hwtimer_job **slot;      // List the job is in, NULL if not running
+    uint32_t expires;               // Wheel tick of next run
+    uint32_t period;                // Ticks between runs, 0 for one-shot
+    timer_callback_t callback;
+#if HWTIMER_PROFILE
+    hwtimer_profile_t profile;
+    struct hwtimer_job *profile_next;   // List of all jobs, for hwtimer_profile_dump()
+#endif
+} hwtimer_job_t;
+
+// Stopwatch, zeroed one measures from start of timebase
+typedef struct {
+    uint64_t start_us;
+} hwtimer_stopwatch_t;
+
 
 /**
  * @brief Initialize the hardware timer that periodically reloads (repeats).
@@ -92,44 +160,120 @@ esp_err_t hwtimer_once_init(int timer_id, uint32_t resolution, uint64_t timer_co
 void hwtimer_once_start(int timer_id);
 
 /**
- * @brief Initialize the hardware timer that acts as a clock
+ * @brief Initialize timer wheel
  * 
- * Contains 2 iteration (time) tracking variables, can be accessed and reseted independently
+ * Creates and starts the hardware timer of the wheel. Called by the
+ * first hwtimer_job_start() if not before (has to be from a task).
  * 
- * @param resolution    Counter resolution (working frequency) in Hz,
-                        hence, the step size of each count tick equals to (1 / resolution_hz) seconds
- * @param timer_count   Alarm target count value (for resolution=1000000 timer_interval is period in microseconds)
  * @return ESP_OK on success, or an error code otherwise.
  */
-esp_err_t hwtimer_clock_init(uint32_t resolution, uint64_t timer_count);
+esp_err_t hwtimer_wheel_init(void);
+
+/**
+ * @brief Initialize job of timer wheel
+ * 
+ * @param job       Job (has to stay valid while it runs)
+ * @param callback  Function called from timer interrupt when job runs
+ */
+void hwtimer_job_init(hwtimer_job_t *job, timer_callback_t callback);
+
+/**
+ * @brief Start (or restart) job of timer wheel
+ * 
+ * Times are rounded up to HWTIMER_WHEEL_TICK_US (at least one tick),
+ * delays longer than HWTIMER_WHEEL_MAX_TICKS are shortened.
+ * Can be called from job callbacks.
+ * 
+ * @param job       Initialized job
+ * @param delay_us  Time to first run
+ * @param period_us Time between runs, 0 to run just once
+ * 
+ * @return ESP_OK on success, or an error code otherwise.
+ */
+esp_err_t hwtimer_job_start(hwtimer_job_t *job, uint32_t delay_us, uint32_t period_us);
+
+/**
+ * @brief Stop job of timer wheel
+ * 
+ * Can be called from job callbacks, also if the job doesn't run.
+ * 
+ * @param job       Job to be stopped
+ */
+void hwtimer_job_stop(hwtimer_job_t *job);
 
+/**
+ * @brief Get time of timebase
+ * 
+ * Reads counter of the wheel timer, so it's exact to the microsecond
+ * and costs no interrupt. Can be called from interrupts.
+ * 
+ * @return Microseconds since hwtimer_wheel_init(), 0 before it
+ */
+uint64_t hwtimer_get_us(void);
 
 /**
- * @brief Get time from 1. clock
- * Clock used to track time of each state
+ * @brief (Re)start stopwatch from current time
  * 
- * @return Returns number of completed iteration of timer
+ * @param stopwatch Stopwatch
  */
-uint32_t hwtimer_get_time();
+void hwtimer_stopwatch_start(hwtimer_stopwatch_t *stopwatch);
 
 /**
- * @brief Resets 1. clock (iteration/time tracking variable)
+ * @brief Get time since stopwatch was started
  * 
+ * @param stopwatch Stopwatch
+ * 
+ * @return Elapsed time in microseconds
  */
-void hwtimer_reset_clock();
+uint64_t hwtimer_stopwatch_elapsed_us(const hwtimer_stopwatch_t *stopwatch);
 
 /**
- * @brief Get time from 2. clock 
- * Clock used for switching between states in random walk
+ * @brief Get profile of timer id (callbacks of hwtimer_init() and hwtimer_once_init())
+ * 
+ * Profile is zeroed if HWTIMER_PROFILE is disabled.
+ * 
+ * @param timer_id  Chosen timer
+ * @param profile   Copy of profile
+ * 
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for wrong timer_id
+ */
+esp_err_t hwtimer_profile_get(int timer_id, hwtimer_profile_t *profile);
+
+/**
+ * @brief Get profile of whole timer wheel interrupt (all jobs of a tick together)
+ * 
+ * @param profile   Copy of profile
+ */
+void hwtimer_wheel_profile_get(hwtimer_profile_t *profile);
+
+/**
+ * @brief Get profile of wheel job
+ * 
+ * Latency of job includes jobs that ran before it in the same tick.
+ * 
+ * @param job       Job
+ * @param profile   Copy of profile
+ */
+void hwtimer_job_profile_get(const hwtimer_job_t *job, hwtimer_profile_t *profile);
+
+/**
+ * @brief Get percentile of histogram
+ * 
+ * @param hist      Histogram
+ * @param percent   Percentile (50 for median, 100 for max)
  * 
- * @return Returns number of completed iteration of timer
+ * @return Upper bound of bucket with the percentile (us), max_us if that's lower
+ *         or the percentile falls in the last bucket, 0 for empty histogram
  */
-uint32_t hwtimer_cmd_get_time();
+uint32_t hwtimer_hist_percentile(const hwtimer_hist_t *hist, int percent);
 
 /**
- * @brief Resets 2. clock (iteration/time tracking variable)
+ * @brief Log p50/p99/max of latency and execution time of all
+ * timer ids in use, timer wheel and each wheel job
  * 
+ * Jobs are named by address of their callback. Does nothing if
+ * HWTIMER_PROFILE is disabled.
  */
-void hwtimer_cmd_reset_clock();
+void hwtimer_profile_dump(void);
 
-#endif // HWTIMER_H
\ No newline at end of file
+#endif // HWTIMER_H
@@ -91,4 +91,19 @@ typedef enum
     #define SERVO_ROTATE_LEFT       900
 #endif
 
+// Angular response of IR receivers (coop_signal_bearing), in order of
+// communication channels (FRONT, FRONT_RIGHT, BACK_RIGHT, BACK, BACK_LEFT, FRONT_LEFT).
+// Measured per robot, define them in the ROBOT_ID block above to override these.
+#ifndef COOP_RX_ANGLE_DEG
+    #define COOP_RX_ANGLE_DEG       {0, 60, 120, 180, 240, 300}     // Direction of strongest response, clockwise from front
+#endif
+#ifndef COOP_RX_GAIN_Q8
+    #define COOP_RX_GAIN_Q8         {256, 256, 256, 256, 256, 256}  // Sensitivity correction (256 = 1.0)
+#endif
+// Offset from strongest receiver towards stronger neighbour (256 = whole gap between them)
+// for neighbour/strongest ratio 0, 1/8, ... 8/8. Default is for cosine response of receivers.
+#ifndef COOP_BEARING_RESPONSE
+    #define COOP_BEARING_RESPONSE   {0, 0, 0, 0, 0, 35, 69, 100, 128}
+#endif
+
 #endif
\ No newline at end of file
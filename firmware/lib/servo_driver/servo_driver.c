@@ -1,5 +1,21 @@
 #include "servo_driver.h"
 
+// Motion queue
+typedef struct {
+    servo_motion_t motion;
+    uint32_t id;
+} motion_item_t;
+
+static QueueHandle_t motion_queue = NULL;
+static TaskHandle_t motion_task = NULL;
+static volatile uint32_t motion_pushed = 0;     // Id of last queued segment
+static volatile uint32_t motion_finished = 0;   // Id of last ended segment, all are after cancel
+
+// Queued motion runs and caller is not the motion task
+static bool motion_owned(void) {
+    return servo_motion_busy() && (xTaskGetCurrentTaskHandle() != motion_task);
+}
+
 
 void servo_init(ledc_channel_t channel, int gpio) {
     ledc_timer_config_t timer_conf = {
@@ -32,27 +48,38 @@ void servo_set_speed(ledc_channel_t channel, int speed) {
 }
 
 void servo_move_forward(int speed){
+    if (motion_owned()) return;
     servo_set_speed(SERVO_LEFT_CHANNEL, speed + SERVO_FORWARD_LEFT_MOD); 
     //servo_set_speed(SERVO_RIGHT_CHANNEL, -(speed/abs(speed) * (abs(speed)-10))); 
     servo_set_speed(SERVO_RIGHT_CHANNEL, -speed);
 }
 
 void servo_move_backwards(int speed){
+    if (motion_owned()) return;
     servo_set_speed(SERVO_LEFT_CHANNEL, -speed);  
     servo_set_speed(SERVO_RIGHT_CHANNEL, speed + SERVO_BACKWARDS_RIGHT_MOD); 
 }
 
 void servo_rotate_right(int speed){
+    if (motion_owned()) return;
     servo_set_speed(SERVO_LEFT_CHANNEL, speed);  
     servo_set_speed(SERVO_RIGHT_CHANNEL, speed);
 }
 void servo_rotate_left(int speed){
+    if (motion_owned()) return;
     servo_set_speed(SERVO_LEFT_CHANNEL, -speed);  
     servo_set_speed(SERVO_RIGHT_CHANNEL, -speed); 
 }
 
+void servo_steer(int speed, int turn){
+    if (motion_owned()) return;
+    servo_set_speed(SERVO_LEFT_CHANNEL, speed + turn + (speed ? SERVO_FORWARD_LEFT_MOD : 0));
+    servo_set_speed(SERVO_RIGHT_CHANNEL, -(speed - turn));
+}
+
 // Rotate right for a little more than 90°
 void servo_rotate_right_91(void){
+    if (motion_owned()) return;
     servo_set_speed(SERVO_LEFT_CHANNEL, SERVO_ROTATE_RIGHT_SPEED);  
     servo_set_speed(SERVO_RIGHT_CHANNEL, SERVO_ROTATE_RIGHT_SPEED); 
     vTaskDelay(pdMS_TO_TICKS(SERVO_ROTATE_RIGHT));
@@ -61,6 +88,7 @@ void servo_rotate_right_91(void){
 
 // Rotate left for a little more than 90°
 void servo_rotate_left_91(void){
+    if (motion_owned()) return;
     servo_set_speed(SERVO_LEFT_CHANNEL, -SERVO_ROTATE_LEFT_SPEED); 
     servo_set_speed(SERVO_RIGHT_CHANNEL, -SERVO_ROTATE_LEFT_SPEED);
     vTaskDelay(pdMS_TO_TICKS(SERVO_ROTATE_LEFT));
@@ -70,6 +98,120 @@ void servo_rotate_left_91(void){
 
 
 void servo_stop(void){
+    if (motion_owned()) return;
     servo_set_speed(SERVO_LEFT_CHANNEL, 0);  
     servo_set_speed(SERVO_RIGHT_CHANNEL, 0); 
-}
\ No newline at end of file
+}
+
+
+
+// **************       Motion queue       **************
+
+static void motion_apply(const servo_motion_t *motion) {
+    switch (motion->type) {
+        case SERVO_MOTION_STOP:         servo_stop(); break;
+        case SERVO_MOTION_FORWARD:      servo_move_forward(motion->speed); break;
+        case SERVO_MOTION_BACKWARDS:    servo_move_backwards(motion->speed); break;
+        case SERVO_MOTION_ROTATE_RIGHT: servo_rotate_right(motion->speed); break;
+        case SERVO_MOTION_ROTATE_LEFT:  servo_rotate_left(motion->speed); break;
+        case SERVO_MOTION_STEER:        servo_steer(motion->speed, motion->turn); break;
+    }
+}
+
+static void motion_task_loop(void *arg) {
+    motion_item_t item;
+
+    while (1) {
+        xQueueReceive(motion_queue, &item, portMAX_DELAY);
+        if (servo_motion_done(item.id)) continue;   // Cancelled while queued
+
+        motion_apply(&item.motion);
+        if (servo_motion_done(item.id)) {           // Cancelled meanwhile, servo_stop() might have been before
+            servo_stop();
+            continue;
+        }
+
+        // servo_motion_cancel() wakes the task up early
+        TickType_t start = xTaskGetTickCount();
+        TickType_t ticks = pdMS_TO_TICKS(item.motion.duration_ms);
+        while (!servo_motion_done(item.id) && (xTaskGetTickCount() - start < ticks)) {
+            ulTaskNotifyTake(pdTRUE, ticks - (xTaskGetTickCount() - start));
+        }
+        if (servo_motion_done(item.id)) continue;
+
+        // Timed segment doesn't leave the robot moving
+        if (item.motion.duration_ms && !uxQueueMessagesWaiting(motion_queue)) servo_stop();
+
+        motion_finished = item.id;
+        if (item.motion.done) item.motion.done(item.id, item.motion.arg);
+    }
+}
+
+esp_err_t servo_motion_init(void) {
+    if (motion_queue != NULL) return ESP_OK;
+
+    motion_queue = xQueueCreate(SERVO_MOTION_QUEUE_LEN, sizeof(motion_item_t));
+    if (motion_queue == NULL) return ESP_ERR_NO_MEM;
+    if (xTaskCreatePinnedToCore(motion_task_loop, "servo_motion", SERVO_MOTION_TASK_STACK, NULL, SERVO_MOTION_TASK_PRIORITY, &motion_task, SERVO_MOTION_TASK_CORE) != pdPASS) {
+        vQueueDelete(motion_queue);
+        motion_queue = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+// Segments are queued (and cancelled) from one task, no lock needed
+uint32_t servo_motion_push(const servo_motion_t *motion) {
+    if (motion_queue == NULL) return 0;
+
+    motion_item_t item = {
+        .motion = *motion,
+        .id = motion_pushed + 1,
+    };
+
+    // Busy before the task can take it, direct functions stop working now
+    motion_pushed = item.id;
+    if (xQueueSend(motion_queue, &item, 0) != pdTRUE) {
+        motion_pushed = item.id - 1;
+        return 0;
+    }
+    return item.id;
+}
+
+uint32_t servo_motion_segment(servo_motion_type_t type, int speed, uint32_t duration_ms) {
+    servo_motion_t motion = {
+        .type = type,
+        .speed = speed,
+        .duration_ms = duration_ms,
+    };
+    return servo_motion_push(&motion);
+}
+
+uint32_t servo_motion_rotate_by(int degrees) {
+    bool right = (degrees >= 0);
+    servo_motion_t motion = {
+        .type = right ? SERVO_MOTION_ROTATE_RIGHT : SERVO_MOTION_ROTATE_LEFT,
+        .speed = right ? SERVO_ROTATE_RIGHT_SPEED : SERVO_ROTATE_LEFT_SPEED,
+        .duration_ms = abs(degrees) * (right ? SERVO_ROTATE_RIGHT : SERVO_ROTATE_LEFT) / 91,
+    };
+
+    if (!motion.duration_ms) motion.duration_ms = 1;    // Has to stay timed
+    return servo_motion_push(&motion);
+}
+
+bool servo_motion_done(uint32_t id) {
+    return (int32_t)(motion_finished - id) >= 0;
+}
+
+bool servo_motion_busy(void) {
+    return motion_finished != motion_pushed;
+}
+
+void servo_motion_cancel(void) {
+    if (motion_queue == NULL) return;
+
+    xQueueReset(motion_queue);
+    motion_finished = motion_pushed;
+    xTaskNotifyGive(motion_task);
+    servo_stop();
+}
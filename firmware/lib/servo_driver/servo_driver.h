@@ -10,16 +10,33 @@
  * different surface than it was calibrated for, might 
  * not work.
  * 
+ * Motion queue moves the robot without blocking the caller. Moves
+ * (segments) are queued and a motion task runs them one after another,
+ * timed segments end after their duration (with stop, if nothing else
+ * is queued), untimed ones set the speed and keep it until the next one.
+ * Each queued segment gets an id to check if it's done and can have
+ * a callback, called from the motion task when it ends.
+ * While queued motion runs, direct movement functions (servo_move_forward(),
+ * servo_stop()...) are ignored, so the behaviour loop can keep running
+ * without cutting turns short. servo_motion_cancel() stops everything.
+ * 
  */
 
 
 #ifndef SERVO_DRIVER_H
 #define SERVO_DRIVER_H
 
+// C/C++ libraries
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
 // ESP-IDF libraries
 #include "driver/ledc.h"
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
 
 // Personal libraries
 #include "io_define.h"
@@ -53,6 +70,33 @@
 #define SERVO_ROTATE_LEFT_SPEED   190
 #define SERVO_ROTATE_RIGHT_SPEED  160
 
+// Motion queue
+#define SERVO_MOTION_QUEUE_LEN      8
+#define SERVO_MOTION_TASK_STACK     2048
+#define SERVO_MOTION_TASK_PRIORITY  (configMAX_PRIORITIES - 4)  // Above the behaviour task, below dm_comm tasks
+#define SERVO_MOTION_TASK_CORE      (portNUM_PROCESSORS - 1)        // With the behaviour, away from dm_comm
+
+typedef enum {
+    SERVO_MOTION_STOP,              // Timed stop is a pause
+    SERVO_MOTION_FORWARD,
+    SERVO_MOTION_BACKWARDS,
+    SERVO_MOTION_ROTATE_RIGHT,
+    SERVO_MOTION_ROTATE_LEFT,
+    SERVO_MOTION_STEER,
+} servo_motion_type_t;
+
+typedef void (*servo_motion_done_t)(uint32_t id, void *arg);
+
+// Segment of motion
+typedef struct {
+    servo_motion_type_t type;
+    int speed;                      // Same as for direct functions
+    int turn;                       // Only for SERVO_MOTION_STEER
+    uint32_t duration_ms;           // 0 - untimed, keeps going until next segment
+    servo_motion_done_t done;       // Called when segment ends (not if cancelled), can be NULL
+    void *arg;                      // Argument of callback
+} servo_motion_t;
+
 /**
  * @brief Initialize servomotor
  * 
@@ -101,6 +145,16 @@ void servo_rotate_right(int speed);
  */
 void servo_rotate_left(int speed);
 
+/**
+ * @brief Move forward and turn at the same time
+ * 
+ * Calibrated for each robot (forward part)
+ *
+ * @param speed      Ranges from 0 (rotate in place) to 1000 (full speed)
+ * @param turn       Ranges from -1000 (left) to 1000 (right), 0 goes straight
+ */
+void servo_steer(int speed, int turn);
+
 /**
  * @brief Rotate right by about 90°, mby a lil more            
  */
@@ -116,4 +170,67 @@ void servo_rotate_left_91();    // Rotate left for a little more than 90°
  */
 void servo_stop();
 
+/**
+ * @brief Initialize motion queue and start its task
+ * 
+ * Servomotors have to be initialized before.
+ * 
+ * @return ESP_OK on success, or an error code otherwise.
+ */
+esp_err_t servo_motion_init(void);
+
+/**
+ * @brief Queue segment of motion, doesn't block
+ * 
+ * @param motion     Segment (copied)
+ * 
+ * @return Id of segment, 0 if the queue is full
+ */
+uint32_t servo_motion_push(const servo_motion_t *motion);
+
+/**
+ * @brief Queue timed (or untimed) segment without callback
+ * 
+ * @param type          Kind of movement
+ * @param speed         Ranges from 0 (stop) to 1000 (full speed)
+ * @param duration_ms   Duration, 0 keeps going until next segment
+ * 
+ * @return Id of segment, 0 if the queue is full
+ */
+uint32_t servo_motion_segment(servo_motion_type_t type, int speed, uint32_t duration_ms);
+
+/**
+ * @brief Queue rotation in place by an angle
+ * 
+ * Time is scaled from calibrated rotation of about 91°
+ * (SERVO_ROTATE_RIGHT, SERVO_ROTATE_LEFT), stops at the end
+ * if nothing else is queued.
+ * 
+ * @param degrees    Angle, positive to the right, negative to the left
+ * 
+ * @return Id of segment, 0 if the queue is full
+ */
+uint32_t servo_motion_rotate_by(int degrees);
+
+/**
+ * @brief Check if segment is done (ended or cancelled)
+ * 
+ * @param id         Id from servo_motion_push()
+ */
+bool servo_motion_done(uint32_t id);
+
+/**
+ * @brief Check if queued motion still runs
+ * 
+ * Direct movement functions are ignored while it does.
+ */
+bool servo_motion_busy(void);
+
+/**
+ * @brief Drop all queued segments, cut the running one short and stop
+ * 
+ * Callbacks of dropped segments are not called.
+ */
+void servo_motion_cancel(void);
+
 #endif
\ No newline at end of file
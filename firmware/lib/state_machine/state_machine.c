@@ -24,11 +24,12 @@ static int command3 = 0;
 static bool leader = 0;
 static bool leader_reset = 0;      // flag to delay after being leader
 
-static uint32_t time_now = 0;
-static uint32_t timer_command = 0;
+static uint32_t time_now = 0;       // time in state
+static uint32_t timer_command = 0;  // time of command (random walk moves, messages)
+static hwtimer_stopwatch_t state_clock;
+static hwtimer_stopwatch_t cmd_clock;
 
 // Commands
-static uint8_t direction = 0;
 static int adc_results[CHANNEL_NUM];
 
 static bool cmd_close_enough = 0;
@@ -42,12 +43,19 @@ static int start_flag = 0;
 static bool detect = 0;
 
 
+// State times are counted in BIT_DURATION_US periods
+static uint32_t clock_ticks(const hwtimer_stopwatch_t *clock)
+{
+    return hwtimer_stopwatch_elapsed_us(clock) / BIT_DURATION_US;
+}
+
+
 void state_machine_loop() {
 
     while (1)
     {
-        time_now = hwtimer_get_time();
-        timer_command = hwtimer_cmd_get_time();
+        time_now = clock_ticks(&state_clock);
+        timer_command = clock_ticks(&cmd_clock);
 
         switch (comm_state)
         {
@@ -91,23 +99,47 @@ void state_machine_loop() {
     
 }
 
-void state_machine_init() {
-    // Initialize the communication module
+// Comm, obstacle sensing and timer wheel are set up on DM_CORE, so their interrupts run there
+static void sense_init_task(void *arg) {
+    TaskHandle_t caller = arg;
+
+    hwtimer_wheel_init();
     dm_comm_init(adc1_channels, GET_SIZE(adc1_channels), adc2_channels, GET_SIZE(adc2_channels), led_sig, led_sig_num);
-    hwtimer_clock_init(1000000, BIT_DURATION_US);
+    #if DM_TDMA
+    if (WITH_LEADER && ROBOT_ID == 1) dm_comm_tdma_master(1);
+    #endif
+    coop_dis_init(dis_channels, GET_SIZE(dis_channels), led_dis, led_dis_num);
+
+    xTaskNotifyGive(caller);
+    vTaskDelete(NULL);
+}
+
+static void behaviour_task(void *arg) {
+    state_machine_loop();
+}
+
+void state_machine_init() {
+    xTaskCreatePinnedToCore(sense_init_task, "sense_init", SENSE_INIT_TASK_STACK, xTaskGetCurrentTaskHandle(), configMAX_PRIORITIES - 1, NULL, DM_CORE);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    hwtimer_stopwatch_start(&state_clock);
+    hwtimer_stopwatch_start(&cmd_clock);
 
     servo_init(SERVO_LEFT_CHANNEL, SERVO_LEFT_GPIO);
     servo_init(SERVO_RIGHT_CHANNEL, SERVO_RIGHT_GPIO);
-
-    coop_dis_init(dis_channels, GET_SIZE(dis_channels), led_dis, led_dis_num);
+    servo_motion_init();
 
     srand(esp_random()); // for True RNG
     wait_time = (rand() % RAND_IDLE_TIME) + MIN_IDLE_TIME;
 
-    time_now = hwtimer_get_time();
+    time_now = clock_ticks(&state_clock);
     printf("\n%" PRIu32 " wait for %d", time_now, wait_time);
 }
 
+void state_machine_start() {
+    xTaskCreatePinnedToCore(behaviour_task, "behaviour", BEHAVIOUR_TASK_STACK, NULL, BEHAVIOUR_TASK_PRIORITY, NULL, BEHAVIOUR_CORE);
+}
+
 
 
 void state_idle() {
@@ -124,10 +156,10 @@ void state_idle() {
         comm_state = COMMAND3;
             #endif
 
-        hwtimer_cmd_reset_clock();
-        timer_command = hwtimer_cmd_get_time();
-        hwtimer_reset_clock();
-        time_now = hwtimer_get_time();
+        hwtimer_stopwatch_start(&cmd_clock);
+        timer_command = clock_ticks(&cmd_clock);
+        hwtimer_stopwatch_start(&state_clock);
+        time_now = clock_ticks(&state_clock);
 
         #else
 
@@ -152,7 +184,7 @@ void state_random_walk() {
             printf("\n Signal detected");
             comm_state = LISTEN;
             // signal_correction();
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
         }
 
@@ -161,7 +193,7 @@ void state_random_walk() {
             printf("\n Signal detected");
             comm_state = LISTEN;
             // signal_correction();
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
         }
         #else
@@ -170,7 +202,7 @@ void state_random_walk() {
         if ((time_now >= wait_time)){
             printf("\n Start transmitting");
             comm_state = TRANSMITTING;
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
         }
         #endif
@@ -182,7 +214,7 @@ void state_random_walk() {
             printf("\n Signal detected");
             comm_state = LISTEN;
             // signal_correction();
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
         }
 
@@ -191,7 +223,7 @@ void state_random_walk() {
             printf("\n Signal detected");
             comm_state = LISTEN;
             // signal_correction();
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
         }
 
@@ -199,7 +231,7 @@ void state_random_walk() {
         if ((time_now >= wait_time)){
             printf("\n Start transmitting");
             comm_state = TRANSMITTING;
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
         }
 
@@ -207,27 +239,30 @@ void state_random_walk() {
 }
 
 void state_listen() {
+    dm_frame_t frame;
 
-    if (dm_comm_process()) {
+    // Sleeps until frame arrives, no need to poll
+    if (dm_comm_wait_frame(&frame, LISTEN_WAIT_MS)) {
 
         servo_stop();
         
         printf("\n%" PRIu32 "   1: %d \t 2: %d\n\n", time_now, command1, command2);
 
-        dm_comm_get_messages(rx_msg);
-        
-        for (int i = 0; i < CHANNEL_NUM; i++) {
-            // printf("Received: %d from channel %d\n", rx_msg[i], i);
-            if(rx_msg[i] == CMD_START_SIG) {
+        // Frames that came in meanwhile, each transmission only once (dm_comm skips copies)
+        do {
+            uint8_t rx = frame.len ? frame.payload[0] : 0;
+            // printf("Received: %d from robot %d (seq %d, channel %d)\n", rx, frame.src, frame.seq, frame.channel);
+            if(rx == CMD_START_SIG) {
                 comm_state = COMMAND_RECEIVED;
-                printf("\n  %" PRIu32 "   Command received\n", time_now);
+                // Time and hops from leader, for measuring how fast command spreads (dm_comm relays it)
+                printf("\n  %" PRIu32 "   Command received (robot %d, %d hops, %" PRId64 " us)\n", time_now, frame.src, frame.hops, frame.time_us);
             }
-            if (rx_msg[i] == COMMAND1_SIG) command1++;
-            if (rx_msg[i] == COMMAND2_SIG) command2++;
-            if (rx_msg[i] == COMMAND3_SIG) command3++;
-        }
+            if (rx == COMMAND1_SIG) command1++;
+            if (rx == COMMAND2_SIG) command2++;
+            if (rx == COMMAND3_SIG) command3++;
+        } while (dm_comm_recv_frame(&frame));
 
-        hwtimer_reset_clock();
+        hwtimer_stopwatch_start(&state_clock);
         time_now = 0;
 
         //printf("\n\n");
@@ -245,12 +280,12 @@ void state_listen() {
             command2 = 0;
             command3 = 0;
             printf("\nReset clock");
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
 
             random_walk_start();
-            hwtimer_cmd_reset_clock();
-            timer_command = hwtimer_cmd_get_time();
+            hwtimer_stopwatch_start(&cmd_clock);
+            timer_command = clock_ticks(&cmd_clock);
         }
     }
 }
@@ -261,7 +296,7 @@ void state_transmitting() {
 
     if (!dm_comm_backoff())
     {
-        if (time_now >= MSG_INTERVAL)
+        if (time_now >= CMD_INTERVAL)
         {
 
             if (leader_reset)
@@ -276,24 +311,24 @@ void state_transmitting() {
                     {
                         comm_state = COMMAND1;
                         // random_walk_start();
-                        hwtimer_cmd_reset_clock();
-                        timer_command = hwtimer_cmd_get_time();
+                        hwtimer_stopwatch_start(&cmd_clock);
+                        timer_command = clock_ticks(&cmd_clock);
                         dm_comm_reading_stop();
                     }
                     if (send == 2)
                     {
                         comm_state = COMMAND2;
                         servo_stop();
-                        hwtimer_cmd_reset_clock();
-                        timer_command = hwtimer_cmd_get_time();
+                        hwtimer_stopwatch_start(&cmd_clock);
+                        timer_command = clock_ticks(&cmd_clock);
                         dm_comm_reading_stop();
                     }
                     if (send == 3)
                     {
                         comm_state = COMMAND3;
                         // random_walk_start();
-                        hwtimer_cmd_reset_clock();
-                        timer_command = hwtimer_cmd_get_time();
+                        hwtimer_stopwatch_start(&cmd_clock);
+                        timer_command = clock_ticks(&cmd_clock);
                         // dm_comm_reading_stop();
                     }
                 }
@@ -301,26 +336,31 @@ void state_transmitting() {
                 {
                     comm_state = RANDOM_WALK;
                     random_walk_start();
-                    hwtimer_cmd_reset_clock();
-                    timer_command = hwtimer_cmd_get_time();
+                    hwtimer_stopwatch_start(&cmd_clock);
+                    timer_command = clock_ticks(&cmd_clock);
                     wait_time = (rand() % RAND_WALK_TIME) + MIN_WALK_TIME;
                     printf("\n%" PRIu32 " Start random walk for %d", time_now, wait_time);
                 }
                 return;
             }
 
-            printf("\n%" PRIu32 "\t%d \tTransmitting   %d", time_now, send_num, send);
-            
-            if (send_num++ == 0) send = 1; //(rand() % 2) + 1;
+            if (send_num == 0) send = 1; //(rand() % 2) + 1;
+
+            int message = CMD_START_SIG;    // After all commands
+            if (send_num < MAX_SEND_COUNT) {
+                if (send == 1) message = COMMAND1_SIG;
+                if (send == 2) message = COMMAND2_SIG;
+                if (send == 3) message = COMMAND3_SIG;
+            }
+
+            // Previous frame still waits for channel, try again in next loop
+            if (!dm_comm_send_cmd(message)) return;
 
-            if (send == 1) dm_comm_send(COMMAND1_SIG);
-            if (send == 2) dm_comm_send(COMMAND2_SIG);
-            if (send == 3) dm_comm_send(COMMAND3_SIG);
+            printf("\n%" PRIu32 "\t%d \tTransmitting   %d", time_now, send_num, send);
 
-            if (send_num >= MAX_SEND_COUNT)
+            if (++send_num >= MAX_SEND_COUNT + CMD_START_COUNT)
             {
                 send_num = 0;
-                dm_comm_send(CMD_START_SIG);
                 leader_reset = 1;
                 leader = 1;
                 printf("\n %" PRIu32 " Done sending %d", time_now, send);
@@ -328,7 +368,7 @@ void state_transmitting() {
                 // comm_state = LISTEN;  // RANDOM_WALK;
             }
 
-            hwtimer_reset_clock();
+            hwtimer_stopwatch_start(&state_clock);
             time_now = 0;
         }
     }
@@ -337,8 +377,8 @@ void state_transmitting() {
         send_num = 0;
         comm_state = RANDOM_WALK;
         random_walk_start();
-        hwtimer_cmd_reset_clock();
-        timer_command = hwtimer_cmd_get_time();
+        hwtimer_stopwatch_start(&cmd_clock);
+        timer_command = clock_ticks(&cmd_clock);
         printf("\nChannel occupied");
         wait_time = (rand() % RAND_WALK_TIME) + MIN_WALK_TIME;
         printf("\n%" PRIu32 " Start random walk for %d", time_now, wait_time);
@@ -349,63 +389,63 @@ void state_command_received() {
     if (command1 >= COMMAND_COUNT) {
         // dm_comm_stop();
         dm_comm_reading_stop();
-        hwtimer_cmd_reset_clock();
-        timer_command = hwtimer_cmd_get_time();
+        hwtimer_stopwatch_start(&cmd_clock);
+        timer_command = clock_ticks(&cmd_clock);
         command1 = 0;
         command2 = 0;
         command3 = 0;
         printf("Commencing command 1\n");
         comm_state = COMMAND1;
-        hwtimer_reset_clock();
+        hwtimer_stopwatch_start(&state_clock);
     }
 
     else if (command2 >= COMMAND_COUNT) {
         //dm_comm_stop();
         dm_comm_reading_stop();
-        hwtimer_cmd_reset_clock();
-        timer_command = hwtimer_cmd_get_time();
+        hwtimer_stopwatch_start(&cmd_clock);
+        timer_command = clock_ticks(&cmd_clock);
         coop_start_spread();
         command1 = 0;
         command2 = 0;
         command3 = 0;
         printf("%" PRIu32 " Commencing command 2\n", time_now);
         comm_state = COMMAND2;
-        hwtimer_reset_clock();
+        hwtimer_stopwatch_start(&state_clock);
     }
 
     else if (command3 >= COMMAND_COUNT) {
         // dm_comm_stop();
         // dm_comm_reading_stop();
-        hwtimer_cmd_reset_clock();
-        timer_command = hwtimer_cmd_get_time();
+        hwtimer_stopwatch_start(&cmd_clock);
+        timer_command = clock_ticks(&cmd_clock);
         command1 = 0;
         command2 = 0;
         command3 = 0;
         printf("Commencing command 1\n");
         comm_state = COMMAND3;
-        hwtimer_reset_clock();
+        hwtimer_stopwatch_start(&state_clock);
     }
 
     else comm_state = LISTEN;
 
-    time_now = hwtimer_get_time();
+    time_now = clock_ticks(&state_clock);
 }
 
 void state_command1() {
     if(leader){
-        multiple_led_drive(led_sig, led_sig_num, 1);
+        dm_comm_led_drive(1);
         random_walk_loop(timer_command, comm_state);
         // servo_move_forward(300);
         printf("\n%" PRIu32 " 1: Leader", time_now);
     } else {
 
         dm_comm_get_signals(adc_results);
-        direction = coop_signal_direction(adc_results);
-        printf("%" PRIu32 " \tDirection: %d\n\n",time_now, direction);
-        coop_turn_to_signal(direction);
+        coop_bearing_t bearing = coop_signal_bearing(adc_results);
+        printf("%" PRIu32 " \tBearing: %d (confidence %d)\n\n",time_now, bearing.angle, bearing.confidence);
+        // Steers while moving, no blocking turns
         if (cmd_close_enough) servo_stop();
-        else servo_move_forward(SERVO_MOVE_SPEED);
-        printf("\n%" PRIu32 " 1: Rotating right", time_now);
+        else coop_steer_to_bearing(bearing, SERVO_MOVE_SPEED);
+        printf("\n%" PRIu32 " 1: Following", time_now);
 
     }
 }
@@ -414,8 +454,8 @@ void state_command2() {
     if(leader){
         if ((time_now <= TURN_AWAY_TIME_US + 500) || (time_now >= (TURN_AWAY_TIME_US + FORWARD_TIME_US + REVERSE_TIME_US + FORWARD_TIME_US - 500)))
         {
-            multiple_led_drive(led_sig, led_sig_num, 1);
-        } else multiple_led_drive(led_sig, led_sig_num, 0);
+            dm_comm_led_drive(1);
+        } else dm_comm_led_drive(0);
         
         
         printf("\n%" PRIu32 " 2: Leader", time_now);
@@ -438,7 +478,7 @@ void state_command3_chain() {
     if (leader || (WITH_LEADER && ROBOT_ID==1)) {
         if (timer_command >= MSG_INTERVAL) {
             dm_comm_send(1);  // Leader sends "1"
-            hwtimer_cmd_reset_clock();
+            hwtimer_stopwatch_start(&cmd_clock);
             timer_command = 0;
         }
         random_walk_loop(time_now, comm_state);
@@ -451,10 +491,19 @@ void state_command3_chain() {
         dm_comm_get_messages(rx_msg);
         for (int i = 0; i < CHANNEL_NUM; i++) {
             if (rx_msg[i] == (ROBOT_ID-1))  {
-                printf("\nTarget: %d   Direction: %d", ROBOT_ID-1, i);
-                coop_turn_to_signal(i);
-                
-                // dm_comm_get_msg_strength(adc_results);
+                int peak[CHANNEL_NUM];
+                int target_dir = i;
+
+                // Strongest channel of the frame, not just the first one that decoded it
+                if (dm_comm_get_frame_strength(ROBOT_ID-1, peak, adc_results)) target_dir = coop_signal_direction(adc_results);
+
+                printf("\nTarget: %d   Direction: %d", ROBOT_ID-1, target_dir);
+                // Turn is queued, frames keep being decoded meanwhile
+                if (coop_turn_to_signal(target_dir)) {
+                    if (cmd_close_enough) servo_motion_segment(SERVO_MOTION_STOP, 0, 0);
+                    else servo_motion_segment(SERVO_MOTION_FORWARD, SERVO_MOVE_SPEED+100, 0);
+                    break;
+                }
                 
                 // if (cmd_close_enough) {
                 //     servo_stop();
@@ -473,7 +522,7 @@ void state_command3_chain() {
     // Send your own ID so next robot can follow you
     if (timer_command >= MSG_INTERVAL) {
         dm_comm_send(ROBOT_ID);
-        hwtimer_cmd_reset_clock();
+        hwtimer_stopwatch_start(&cmd_clock);
         timer_command = 0;
     }
 }
@@ -490,7 +539,7 @@ void state_command3_chain() {
 //     if (leader) {
 //         if (timer_command >= MSG_INTERVAL)) {
 //             dm_comm_send(1);  // Leader sends "1"
-//             hwtimer_cmd_reset_clock();
+//             hwtimer_stopwatch_start(&cmd_clock);
 //             timer_command = 0;
 //         }
 //         random_walk_loop(time_now, comm_state);
@@ -504,7 +553,7 @@ void state_command3_chain() {
 //         int direction_of_highest = -1;
 
 //         while (timer_command <= (ROBOT_ID * 500 + (ROBOT_ID-2)*700)){
-//             timer_command = hwtimer_cmd_get_time();
+//             timer_command = clock_ticks(&cmd_clock);
 //             printf("\n Waiting  %" PRIu32 "...", timer_command);
 //         }
         
@@ -554,7 +603,7 @@ void state_command3_chain() {
 //         // Send your own ID so next robot can follow you
 //         if (timer_command >= MSG_INTERVAL)) {
 //             dm_comm_send(my_id);
-//             hwtimer_cmd_reset_clock();
+//             hwtimer_stopwatch_start(&cmd_clock);
 //             timer_command = 0;
 //         }
 //     }
@@ -566,7 +615,7 @@ void state_command_clear() {
     if(comm_state >= COMMAND1 && (time_now  >= (COMMAND_PERIOD))) {
         // dm_comm_start();                 // well... dm_comm_stop and dm_comm_start crashes, not needed I guess
         // vTaskDelay(pdMS_TO_TICKS(10));   // ??? without delay crashes, crashes even with, but later (after 2. or 3. iteration) ???
-        multiple_led_drive(led_sig, led_sig_num, 0);
+        dm_comm_led_drive(0);
         dm_comm_reading_start();
         servo_stop();          
         printf("\n Command stopped");
@@ -576,11 +625,11 @@ void state_command_clear() {
         leader = 0;
         random_walk_start();
         //printf("\nReset clock");
-        hwtimer_cmd_reset_clock();
-        timer_command = hwtimer_cmd_get_time();
+        hwtimer_stopwatch_start(&cmd_clock);
+        timer_command = clock_ticks(&cmd_clock);
         cmd2_return = 0;
         printf("\n%" PRIu32 " Start random walk for %d", time_now, wait_time);
-        hwtimer_reset_clock();
+        hwtimer_stopwatch_start(&state_clock);
         time_now = 0;
     }
 }
@@ -589,7 +638,9 @@ void state_command_clear() {
 
 void obstacle_avoidance() {
     if (coop_obstacle_detection()) {
-        printf("\n Obstacle detected");
+        // Backing off or turning away is queued, distance is still followed but nothing new is queued
+        bool busy = servo_motion_busy();
+        if (!busy) printf("\n Obstacle detected");
         if ((comm_state == COMMAND1 && !leader) || (comm_state == COMMAND2 && cmd2_return) || (comm_state == COMMAND3 && !(leader || (WITH_LEADER && ROBOT_ID==1)))) { 
             // if (comm_state != COMMAND3) dm_comm_get_signals(adc_results);
             
@@ -604,20 +655,20 @@ void obstacle_avoidance() {
             
             dm_comm_get_signals(adc_results);
             if (adc_results[0] >= (SIG_THRESHOLD + 3500)) {
-                servo_move_backwards(500);
-                vTaskDelay(pdMS_TO_TICKS(200));
-                servo_stop();
-                vTaskDelay(pdMS_TO_TICKS(10));
+                if (!busy) {
+                    servo_motion_segment(SERVO_MOTION_BACKWARDS, 500, 200);
+                    servo_motion_segment(SERVO_MOTION_STOP, 0, 10);
+                }
             } 
             else if (adc_results[0] >= (SIG_THRESHOLD + 3200)){
                 cmd_close_enough = 1;
                 // servo_rotate_right_91();     // is it needed?
             }
             else cmd_close_enough = 0;
-        } else {
-            servo_rotate_right_91();
-            if (leader || (WITH_LEADER && ROBOT_ID==1)) servo_move_forward(SERVO_MOVE_SPEED);
-            else servo_stop();
+        } else if (!busy) {
+            servo_motion_rotate_by(91);
+            if (leader || (WITH_LEADER && ROBOT_ID==1)) servo_motion_segment(SERVO_MOTION_FORWARD, SERVO_MOVE_SPEED, 0);
+            else servo_motion_segment(SERVO_MOTION_STOP, 0, 0);
             //if (comm_state == COMMAND2) // log movement
         }
     }
@@ -24,6 +24,11 @@
  * 
  * state_chain is implemented in coop.h, coop.c.
  * 
+ * Communication and sensing run on DM_CORE (see dm_comm.h), states
+ * run in behaviour task on BEHAVIOUR_CORE together with motion task
+ * of servo_driver. Behaviour gets signals from snapshots and frames
+ * from queues of dm_comm, so it never waits for ADC.
+ * 
  */
 
 #ifndef STATE_MACHINE_H
@@ -36,6 +41,7 @@
 
 // ESP-IDF libraries
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_random.h"
 
 // Personal libraries
@@ -52,6 +58,13 @@
 #define RAND_WALK_TIME  5000    // Additional WALK time chosen randomly
 
 #define LISTEN_TIME     2000    // LISTEN time before going back to random walk
+#define LISTEN_WAIT_MS  10      // Longest wait for a frame in LISTEN, timeouts are checked in between
+
+// Tasks
+#define BEHAVIOUR_CORE          (portNUM_PROCESSORS - 1)    // Away from DM_CORE
+#define BEHAVIOUR_TASK_STACK    4096
+#define BEHAVIOUR_TASK_PRIORITY (tskIDLE_PRIORITY + 1)      // As main task, loop doesn't block in every state
+#define SENSE_INIT_TASK_STACK   4096
 
 typedef enum {
     IDLE,
@@ -75,9 +88,20 @@ void state_machine_loop();
 
 /**
  * @brief Initialize state machine
+ * 
+ * Communication, obstacle sensing and timer wheel are initialized
+ * by short task on DM_CORE, so their interrupts run on that core.
+ * Returns after everything is initialized.
  */
 void state_machine_init();
 
+/**
+ * @brief Start behaviour task
+ * 
+ * Runs state_machine_loop on BEHAVIOUR_CORE. Call after state_machine_init.
+ */
+void state_machine_start();
+
 
 /**
  * @brief State IDLE
@@ -2,5 +2,5 @@
 
 void app_main() {
     state_machine_init();
-    state_machine_loop();
+    state_machine_start();
 }
\ No newline at end of file